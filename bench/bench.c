@@ -0,0 +1,957 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "osmem.h"
+#include "trace.h"
+
+// one operation out of LAT_EVERY is timed on its own, so the clock does
+// not dominate the throughput
+#define LAT_EVERY	16
+
+// latencies are counted in buckets of 1/16 of a power of two of ns
+#define LAT_BUCKETS	1024
+
+#define MAX_THREADS	64
+
+#define DIE(assertion, call_description)								\
+	do {																\
+		if (assertion) {												\
+			fprintf(stderr, "(%s, %d): ", __FILE__, __LINE__);			\
+			perror(call_description);									\
+			exit(EXIT_FAILURE);											\
+		}																\
+	} while (0)
+
+/* the functions a benchmark allocates with, os_*() or the ones of glibc;
+ * os_*() also have the placement policy they run with, and the heap they
+ * leave is looked at with os_mallinfo()
+ */
+struct allocator {
+	const char *name;
+	void *(*malloc)(size_t size);
+	void *(*calloc)(size_t nmemb, size_t size);
+	void *(*realloc)(void *ptr, size_t size);
+	void *(*memalign)(size_t alignment, size_t size);
+	void (*free)(void *ptr);
+	struct os_mallinfo (*mallinfo)(void);
+	int fit;
+};
+
+// libosmem.so also exports malloc() and the others, for LD_PRELOAD, so
+// glibc is called through the names it exports its own functions as
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+
+struct allocator allocators[] = {
+	{ "osmem", os_malloc, os_calloc, os_realloc, os_memalign, os_free,
+	  os_mallinfo, OS_FIT_BEST },
+	{ "glibc", __libc_malloc, __libc_calloc, __libc_realloc, __libc_memalign,
+	  __libc_free, NULL, -1 },
+};
+
+// with -p, the placement policies of os_*() are compared instead
+struct allocator policies[] = {
+	{ "osmem best fit", os_malloc, os_calloc, os_realloc, os_memalign,
+	  os_free, os_mallinfo, OS_FIT_BEST },
+	{ "osmem good fit", os_malloc, os_calloc, os_realloc, os_memalign,
+	  os_free, os_mallinfo, OS_FIT_GOOD },
+	{ "osmem first fit", os_malloc, os_calloc, os_realloc, os_memalign,
+	  os_free, os_mallinfo, OS_FIT_FIRST },
+	{ "osmem next fit", os_malloc, os_calloc, os_realloc, os_memalign,
+	  os_free, os_mallinfo, OS_FIT_NEXT },
+};
+
+#define NALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+#define NPOLICIES (sizeof(policies) / sizeof(policies[0]))
+
+/* what a thread of a benchmark counts; a benchmark that has something to
+ * set up first starts the clock of the first thread again after it, and
+ * one that keeps a working set has the first thread look at the heap
+ * before it frees the set, see bench_heap()
+ */
+struct bench_thread {
+	const struct allocator *a;
+	uint64_t start;
+	long heap_free;
+	long frag;
+	uint64_t seed;
+	uint64_t ops;
+	uint64_t lat[LAT_BUCKETS];
+	pthread_t tid;
+	void *arg;
+};
+
+/* what a benchmark run sends back from its process */
+struct bench_result {
+	uint64_t ops;
+	uint64_t ns;
+	uint64_t p50;
+	uint64_t p99;
+	long rss;
+	// free heap KiB and % of them not in the largest free block, or -1
+	long heap_free;
+	long frag;
+	// cache misses of the run, in user space, or -1 if they cannot be
+	// counted
+	long misses;
+};
+
+struct bench {
+	const char *name;
+	void (*run)(struct bench_thread *threads, size_t arg);
+	size_t arg;
+};
+
+// how much work every benchmark does, and with how many threads
+unsigned int scale = 1;
+unsigned int nthreads = 4;
+const char *trace_path;
+int count_misses;
+
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift, every thread has its own state */
+uint64_t rng(uint64_t *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+
+	return *seed;
+}
+
+unsigned int lat_bucket(uint64_t ns)
+{
+	if (ns < 16)
+		return ns;
+
+	unsigned int log = 63 - __builtin_clzll(ns);
+
+	return (log - 3) * 16 + ((ns >> (log - 4)) & 15);
+}
+
+/* the smallest latency of a bucket, the opposite of lat_bucket() */
+uint64_t lat_value(unsigned int idx)
+{
+	if (idx < 16)
+		return idx;
+
+	unsigned int log = idx / 16 + 3;
+
+	return (16ULL + idx % 16) << (log - 4);
+}
+
+// time the i-th operation of a thread, if it is one that is timed
+#define TIMED(t, i, op)													\
+	do {																\
+		if ((i) % LAT_EVERY == 0) {										\
+			uint64_t lat_start = now_ns();								\
+			op;															\
+			(t)->lat[lat_bucket(now_ns() - lat_start)]++;				\
+		} else {														\
+			op;															\
+		}																\
+	} while (0)
+
+/* start counting the cache misses of the process and of the threads it
+ * creates from now on; returns the counter, or -1 if there is none, like
+ * in most virtual machines
+ */
+int misses_open(void)
+{
+	struct perf_event_attr attr = {
+		.size = sizeof(attr),
+		.type = PERF_TYPE_HARDWARE,
+		.config = PERF_COUNT_HW_CACHE_MISSES,
+		.inherit = 1,
+		.exclude_kernel = 1,
+		.exclude_hv = 1,
+	};
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* read a counter opened by misses_open(), the threads that have exited
+ * included
+ */
+long misses_read(int fd)
+{
+	uint64_t count;
+
+	if (fd == -1 || read(fd, &count, sizeof(count)) != sizeof(count))
+		return -1;
+
+	close(fd);
+
+	return count;
+}
+
+/* look at the heap a working set leaves, with the fragmentation that
+ * os_mallinfo() reports; there is nothing to look at with glibc
+ */
+void bench_heap(struct bench_thread *t)
+{
+	if (!t->a->mallinfo)
+		return;
+
+	struct os_mallinfo info = t->a->mallinfo();
+
+	t->heap_free = info.fordblks / 1024;
+	t->frag = info.fragmentation;
+}
+
+/* memory for the bookkeeping of the benchmarks is mapped, so it never
+ * comes from the allocator being measured
+ */
+void *bench_map(size_t len)
+{
+	void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	DIE(ptr == MAP_FAILED, "mmap");
+
+	return ptr;
+}
+
+size_t churn_size(uint64_t *seed)
+{
+	// mostly small objects, like most programs
+	uint64_t r = rng(seed);
+
+	return (r & 3) ? 8 + (r >> 8) % 248 : 256 + (r >> 8) % 3840;
+}
+
+/* single thread churn: replace random objects of a working set */
+void bench_churn(struct bench_thread *threads, size_t arg)
+{
+	struct bench_thread *t = &threads[0];
+	size_t slots = 1 << 14, n = 2000000UL * scale;
+	void **set = bench_map(slots * sizeof(*set));
+
+	(void) arg;
+
+	for (size_t i = 0; i < n; i++) {
+		size_t slot = rng(&t->seed) % slots;
+
+		TIMED(t, i, t->a->free(set[slot]));
+
+		size_t size = churn_size(&t->seed);
+
+		TIMED(t, i + 1, set[slot] = t->a->malloc(size));
+		*(char *) set[slot] = 1;
+	}
+
+	bench_heap(t);
+
+	for (size_t i = 0; i < slots; i++)
+		t->a->free(set[i]);
+
+	t->ops = 2 * n + slots;
+	munmap(set, slots * sizeof(*set));
+}
+
+/* heap churn: the same, with a working set of 4K heap blocks from 1 KiB
+ * to 64 KiB, which leaves holes of every size behind
+ */
+void bench_frag(struct bench_thread *threads, size_t arg)
+{
+	struct bench_thread *t = &threads[0];
+	size_t slots = 1 << 12, n = 200000UL * scale;
+	void **set = bench_map(slots * sizeof(*set));
+
+	(void) arg;
+
+	for (size_t i = 0; i < n; i++) {
+		size_t slot = rng(&t->seed) % slots;
+		uint64_t r = rng(&t->seed);
+		size_t size = (1024UL << (r % 7)) + (r >> 8) % 1024;
+
+		TIMED(t, i, t->a->free(set[slot]));
+		TIMED(t, i + 1, set[slot] = t->a->malloc(size));
+		*(char *) set[slot] = 1;
+	}
+
+	bench_heap(t);
+
+	for (size_t i = 0; i < slots; i++)
+		t->a->free(set[i]);
+
+	t->ops = 2 * n + slots;
+	munmap(set, slots * sizeof(*set));
+}
+
+/* size sweep: allocate a few objects of one size and free them, again
+ * and again
+ */
+void bench_sweep(struct bench_thread *threads, size_t size)
+{
+	struct bench_thread *t = &threads[0];
+	size_t n = 200000UL * scale;
+	void *set[32];
+
+	// big sizes are bounded by page faults, not by the allocator
+	if (size > 64 * 1024)
+		n /= 8;
+
+	for (size_t i = 0; i < n; i += 32) {
+		for (size_t j = 0; j < 32; j++) {
+			TIMED(t, j, set[j] = t->a->malloc(size));
+			*(char *) set[j] = 1;
+		}
+
+		for (size_t j = 0; j < 32; j++)
+			TIMED(t, j + 1, t->a->free(set[j]));
+	}
+
+	t->ops = 2 * n;
+}
+
+/* realloc growth: grow buffers a few bytes at a time, like a string
+ * builder, starting over once they reach 256 KiB
+ */
+void bench_realloc(struct bench_thread *threads, size_t arg)
+{
+	struct bench_thread *t = &threads[0];
+	size_t n = 500000UL * scale;
+	void *buf[16] = {0};
+	size_t len[16] = {0};
+
+	(void) arg;
+
+	for (size_t i = 0; i < n; i++) {
+		size_t k = rng(&t->seed) % 16;
+
+		len[k] += 1 + rng(&t->seed) % 256;
+
+		if (len[k] > 256 * 1024) {
+			TIMED(t, i, t->a->free(buf[k]));
+			buf[k] = NULL;
+			len[k] = 1;
+		}
+
+		TIMED(t, i + 1, buf[k] = t->a->realloc(buf[k], len[k]));
+		((char *) buf[k])[len[k] - 1] = 1;
+	}
+
+	bench_heap(t);
+
+	for (size_t k = 0; k < 16; k++)
+		t->a->free(buf[k]);
+
+	t->ops = n;
+}
+
+// objects go from the producers to the consumers a batch at a time
+#define QUEUE_BATCH	32
+#define QUEUE_SLOTS	64
+
+struct queue {
+	void *ring[QUEUE_SLOTS][QUEUE_BATCH];
+	unsigned int head, tail;
+	unsigned int producers;
+	pthread_mutex_t lock;
+	pthread_cond_t not_full, not_empty;
+};
+
+void *producer(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct queue *q = t->arg;
+	size_t n = 1000000UL * scale / QUEUE_BATCH;
+	void *batch[QUEUE_BATCH];
+
+	for (size_t i = 0; i < n; i++) {
+		for (unsigned int j = 0; j < QUEUE_BATCH; j++) {
+			size_t size = churn_size(&t->seed);
+
+			TIMED(t, j, batch[j] = t->a->malloc(size));
+			*(char *) batch[j] = 1;
+		}
+
+		pthread_mutex_lock(&q->lock);
+
+		while (q->tail - q->head == QUEUE_SLOTS)
+			pthread_cond_wait(&q->not_full, &q->lock);
+
+		memcpy(q->ring[q->tail++ % QUEUE_SLOTS], batch, sizeof(batch));
+		pthread_cond_signal(&q->not_empty);
+		pthread_mutex_unlock(&q->lock);
+
+		t->ops += QUEUE_BATCH;
+	}
+
+	pthread_mutex_lock(&q->lock);
+	q->producers--;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+void *consumer(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct queue *q = t->arg;
+	void *batch[QUEUE_BATCH];
+
+	while (1) {
+		pthread_mutex_lock(&q->lock);
+
+		while (q->tail == q->head && q->producers)
+			pthread_cond_wait(&q->not_empty, &q->lock);
+
+		if (q->tail == q->head) {
+			pthread_mutex_unlock(&q->lock);
+			return NULL;
+		}
+
+		memcpy(batch, q->ring[q->head++ % QUEUE_SLOTS], sizeof(batch));
+		pthread_cond_signal(&q->not_full);
+		pthread_mutex_unlock(&q->lock);
+
+		for (unsigned int j = 0; j < QUEUE_BATCH; j++)
+			TIMED(t, j, t->a->free(batch[j]));
+
+		t->ops += QUEUE_BATCH;
+	}
+}
+
+/* producer/consumer: half of the threads allocate, the other half free
+ * what they get, so every free is a remote one
+ */
+void bench_prodcons(struct bench_thread *threads, size_t arg)
+{
+	static struct queue q = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.not_full = PTHREAD_COND_INITIALIZER,
+		.not_empty = PTHREAD_COND_INITIALIZER,
+	};
+	unsigned int half = nthreads > 1 ? nthreads / 2 : 1;
+	int ret;
+
+	(void) arg;
+
+	q.producers = half;
+
+	for (unsigned int i = 0; i < 2 * half; i++) {
+		threads[i].arg = &q;
+		ret = pthread_create(&threads[i].tid, NULL,
+							 i < half ? producer : consumer, &threads[i]);
+		DIE(ret, "pthread_create");
+	}
+
+	for (unsigned int i = 0; i < 2 * half; i++)
+		pthread_join(threads[i].tid, NULL);
+}
+
+// every larson thread owns this many objects
+#define LARSON_SLOTS	1000
+#define LARSON_ROUNDS	8
+
+void *larson_worker(void *arg)
+{
+	struct bench_thread *t = arg;
+	void **set = t->arg;
+	size_t n = 250000UL * scale / LARSON_ROUNDS;
+
+	for (size_t i = 0; i < n; i++) {
+		size_t slot = rng(&t->seed) % LARSON_SLOTS;
+		size_t size = 16 + rng(&t->seed) % 240;
+
+		TIMED(t, i, t->a->free(set[slot]));
+		TIMED(t, i + 1, set[slot] = t->a->malloc(size));
+		*(char *) set[slot] = 1;
+	}
+
+	t->ops += 2 * n;
+
+	return NULL;
+}
+
+/* larson: every thread replaces random objects of its own set, then
+ * exits and hands the set over to a new thread, which frees what the
+ * old one allocated, like a server handing connections to new workers
+ */
+void bench_larson(struct bench_thread *threads, size_t arg)
+{
+	void **sets = bench_map(nthreads * LARSON_SLOTS * sizeof(*sets));
+	int ret;
+
+	(void) arg;
+
+	for (unsigned int round = 0; round < LARSON_ROUNDS; round++) {
+		for (unsigned int i = 0; i < nthreads; i++) {
+			// every round, a thread gets the set of its neighbour
+			threads[i].arg = sets + (i + round) % nthreads * LARSON_SLOTS;
+			ret = pthread_create(&threads[i].tid, NULL, larson_worker,
+								 &threads[i]);
+			DIE(ret, "pthread_create");
+		}
+
+		for (unsigned int i = 0; i < nthreads; i++)
+			pthread_join(threads[i].tid, NULL);
+	}
+
+	for (size_t i = 0; i < nthreads * LARSON_SLOTS; i++)
+		threads[0].a->free(sets[i]);
+
+	munmap(sets, nthreads * LARSON_SLOTS * sizeof(*sets));
+}
+
+/* the table from the pointers of a trace to the live blocks of the
+ * replay, with linear probing
+ */
+struct replay_map {
+	uint64_t *keys;
+	void **vals;
+	size_t mask;
+};
+
+size_t replay_slot(struct replay_map *m, uint64_t key)
+{
+	size_t i = (key >> 4) * 0x9E3779B97F4A7C15ULL >> 20 & m->mask;
+
+	while (m->keys[i] && m->keys[i] != key)
+		i = (i + 1) & m->mask;
+
+	return i;
+}
+
+void replay_remove(struct replay_map *m, size_t i)
+{
+	// move the entries after i back, so no probe sequence is broken
+	size_t j = i;
+
+	m->keys[i] = 0;
+
+	while (1) {
+		j = (j + 1) & m->mask;
+
+		if (!m->keys[j])
+			return;
+
+		size_t home = (m->keys[j] >> 4) * 0x9E3779B97F4A7C15ULL >> 20 &
+					  m->mask;
+
+		if (((j - home) & m->mask) < ((j - i) & m->mask))
+			continue;
+
+		m->keys[i] = m->keys[j];
+		m->vals[i] = m->vals[j];
+		m->keys[j] = 0;
+		i = j;
+	}
+}
+
+/* put the records of a trace in the order of their time; the ones of
+ * every thread already are, so this is a stable merge sort, which is only
+ * needed if the trace has more than one thread
+ */
+void replay_sort(struct trace_record *r, size_t n)
+{
+	size_t i = 1;
+
+	while (i < n && r[i - 1].time <= r[i].time)
+		i++;
+
+	if (i >= n)
+		return;
+
+	struct trace_record *tmp = bench_map(n * sizeof(*r));
+	struct trace_record *src = r, *dst = tmp;
+
+	for (size_t width = 1; width < n; width *= 2) {
+		for (size_t lo = 0; lo < n; lo += 2 * width) {
+			size_t mid = lo + width < n ? lo + width : n;
+			size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+			size_t a = lo, b = mid, k = lo;
+
+			while (a < mid && b < hi)
+				dst[k++] = src[b].time < src[a].time ? src[b++] : src[a++];
+			while (a < mid)
+				dst[k++] = src[a++];
+			while (b < hi)
+				dst[k++] = src[b++];
+		}
+
+		struct trace_record *swap = src;
+
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != r)
+		memcpy(r, src, n * sizeof(*r));
+
+	munmap(tmp, n * sizeof(*r));
+}
+
+/* trace replay: make the calls of a recorded trace, in the order of their
+ * time, from one thread; calls on blocks the trace never allocated are
+ * left out, and so are the records of the unused end of a trace
+ */
+void bench_replay(struct bench_thread *threads, size_t arg)
+{
+	struct bench_thread *t = &threads[0];
+	struct replay_map m;
+	struct stat st;
+
+	(void) arg;
+
+	int fd = open(trace_path, O_RDONLY);
+
+	DIE(fd == -1, "open trace");
+	DIE(fstat(fd, &st) == -1, "fstat trace");
+
+	// the mapping is private, so the records can be sorted in place
+	struct trace_header *h = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+								  MAP_PRIVATE | MAP_POPULATE, fd, 0);
+
+	DIE(h == MAP_FAILED, "mmap trace");
+	close(fd);
+
+	if ((size_t) st.st_size < sizeof(*h) ||
+		memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) ||
+		h->version != TRACE_VERSION ||
+		h->record_size != sizeof(struct trace_record)) {
+		fprintf(stderr, "%s: not a trace\n", trace_path);
+		exit(EXIT_FAILURE);
+	}
+
+	struct trace_record *r = (struct trace_record *) (h + 1);
+	size_t n = (st.st_size - sizeof(*h)) / sizeof(*r);
+
+	// at most n blocks are live at a time, and the table stays half empty
+	m.mask = 1;
+	while (m.mask < 2 * n)
+		m.mask <<= 1;
+	m.keys = bench_map(m.mask * sizeof(*m.keys));
+	m.vals = bench_map(m.mask * sizeof(*m.vals));
+	m.mask--;
+
+	replay_sort(r, n);
+	t->start = now_ns();
+
+	for (size_t i = 0; i < n; i++) {
+		size_t slot, old;
+		void *ptr = NULL;
+
+		switch (r[i].op) {
+		case TRACE_FREE:
+			slot = replay_slot(&m, r[i].ptr);
+			if (!m.keys[slot])
+				continue;
+
+			TIMED(t, i, t->a->free(m.vals[slot]));
+			replay_remove(&m, slot);
+			break;
+		case TRACE_REALLOC:
+			old = replay_slot(&m, r[i].old);
+			if (r[i].old && !m.keys[old])
+				continue;
+
+			ptr = r[i].old ? m.vals[old] : NULL;
+
+			TIMED(t, i, ptr = t->a->realloc(ptr, r[i].size));
+
+			// a failed realloc() leaves the old block where it was
+			if (r[i].old && (ptr || !r[i].size))
+				replay_remove(&m, old);
+			break;
+		case TRACE_MALLOC:
+			TIMED(t, i, ptr = t->a->malloc(r[i].size));
+			break;
+		case TRACE_CALLOC:
+			TIMED(t, i, ptr = t->a->calloc(1, r[i].size));
+			break;
+		case TRACE_MEMALIGN:
+			TIMED(t, i, ptr = t->a->memalign(r[i].old, r[i].size));
+			break;
+		default:
+			continue;
+		}
+
+		t->ops++;
+
+		if (!ptr || !r[i].ptr)
+			continue;
+
+		// a block the trace never freed is replaced
+		slot = replay_slot(&m, r[i].ptr);
+		if (m.keys[slot])
+			t->a->free(m.vals[slot]);
+
+		m.keys[slot] = r[i].ptr;
+		m.vals[slot] = ptr;
+	}
+
+	// what is left is what the program had when the trace stopped
+	bench_heap(t);
+
+	for (size_t i = 0; i <= m.mask; i++)
+		if (m.keys[i])
+			t->a->free(m.vals[i]);
+}
+
+/* run a benchmark in a process of its own, so the peak RSS is its own
+ * and one allocator never sees what the other left behind
+ */
+void bench_run(const struct bench *b, const struct allocator *a,
+			   struct bench_result *res)
+{
+	int fds[2];
+
+	DIE(pipe(fds) == -1, "pipe");
+
+	pid_t pid = fork();
+
+	DIE(pid == -1, "fork");
+
+	if (pid == 0) {
+		struct bench_thread *threads = bench_map(MAX_THREADS *
+												 sizeof(*threads));
+		struct rusage ru;
+		uint64_t total = 0, seen = 0;
+
+		close(fds[0]);
+
+		for (unsigned int i = 0; i < MAX_THREADS; i++) {
+			threads[i].a = a;
+			threads[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+		}
+
+		threads[0].heap_free = -1;
+		threads[0].frag = -1;
+
+		if (a->fit != -1)
+			os_mallopt(OS_M_FIT_POLICY, a->fit);
+
+		int misses = count_misses ? misses_open() : -1;
+
+		threads[0].start = now_ns();
+		b->run(threads, b->arg);
+		res->ns = now_ns() - threads[0].start;
+		res->misses = misses_read(misses);
+
+		getrusage(RUSAGE_SELF, &ru);
+		res->rss = ru.ru_maxrss;
+		res->heap_free = threads[0].heap_free;
+		res->frag = threads[0].frag;
+
+		for (unsigned int i = 0; i < MAX_THREADS; i++) {
+			res->ops += threads[i].ops;
+			for (unsigned int j = 0; j < LAT_BUCKETS; j++)
+				total += threads[i].lat[j];
+		}
+
+		// the percentiles are taken over the sums of the buckets
+		for (unsigned int j = 0; j < LAT_BUCKETS; j++) {
+			uint64_t count = 0;
+
+			for (unsigned int i = 0; i < MAX_THREADS; i++)
+				count += threads[i].lat[j];
+
+			if (seen < total / 2 && seen + count >= total / 2)
+				res->p50 = lat_value(j);
+			if (seen < total * 99 / 100 && seen + count >= total * 99 / 100)
+				res->p99 = lat_value(j);
+
+			seen += count;
+		}
+
+		DIE(write(fds[1], res, sizeof(*res)) != sizeof(*res), "write");
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(fds[1]);
+
+	int status;
+	ssize_t len = read(fds[0], res, sizeof(*res));
+
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+
+	// a run that crashed is reported with no operations
+	if (len != sizeof(*res) || !WIFEXITED(status) || WEXITSTATUS(status))
+		memset(res, 0, sizeof(*res));
+}
+
+struct bench benches[] = {
+	{ "churn", bench_churn, 0 },
+	{ "frag", bench_frag, 0 },
+	{ "sweep/16", bench_sweep, 16 },
+	{ "sweep/64", bench_sweep, 64 },
+	{ "sweep/256", bench_sweep, 256 },
+	{ "sweep/1K", bench_sweep, 1024 },
+	{ "sweep/4K", bench_sweep, 4096 },
+	{ "sweep/16K", bench_sweep, 16 * 1024 },
+	{ "sweep/64K", bench_sweep, 64 * 1024 },
+	{ "sweep/256K", bench_sweep, 256 * 1024 },
+	{ "sweep/1M", bench_sweep, 1024 * 1024 },
+	{ "realloc", bench_realloc, 0 },
+	{ "prodcons", bench_prodcons, 0 },
+	{ "larson", bench_larson, 0 },
+	{ "replay", bench_replay, 0 },
+};
+
+/* a benchmark runs if it was named, or if there were no names; "sweep"
+ * names all the sizes of the sweep
+ */
+int bench_selected(const struct bench *b, int argc, char **argv)
+{
+	if (!strcmp(b->name, "replay") && !trace_path)
+		return 0;
+
+	if (optind == argc)
+		return 1;
+
+	for (int i = optind; i < argc; i++) {
+		size_t len = strlen(argv[i]);
+
+		if (!strncmp(b->name, argv[i], len) &&
+			(b->name[len] == '\0' || b->name[len] == '/'))
+			return 1;
+	}
+
+	return 0;
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-p] [-c] [-s scale] [-j threads] "
+			"[-t trace] [benchmark...]\n", prog);
+	fprintf(stderr, "benchmarks: churn frag sweep realloc prodcons larson "
+			"replay (with -t)\n");
+	fprintf(stderr, "-p compares the placement policies of osmem, and the "
+			"fragmentation they leave\n");
+	fprintf(stderr, "-c also counts the cache misses of every operation\n");
+	exit(EXIT_FAILURE);
+}
+
+/* print a result: the throughput, latencies and peak RSS, or with -p the
+ * throughput, peak RSS and the free heap the working set left; with -c,
+ * the cache misses of an operation follow
+ */
+void result_print(const struct bench_result *res, int fit)
+{
+	unsigned long kops = res->ops * 1000000 / (res->ns ? res->ns : 1);
+
+	if (!res->ops) {
+		printf(" | %-*s", (fit ? 36 : 38) + (count_misses ? 9 : 0),
+			   "failed");
+		return;
+	}
+
+	if (!fit)
+		printf(" | %9lu %8lu %8lu %10ld", kops, (unsigned long) res->p50,
+			   (unsigned long) res->p99, res->rss);
+	else if (res->frag == -1)
+		printf(" | %9lu %10ld %8s %6s", kops, res->rss, "-", "-");
+	else
+		printf(" | %9lu %10ld %8ld %6ld", kops, res->rss, res->heap_free,
+			   res->frag);
+
+	if (!count_misses)
+		return;
+
+	if (res->misses == -1)
+		printf(" %8s", "-");
+	else
+		printf(" %8.2f", (double) res->misses / res->ops);
+}
+
+int main(int argc, char **argv)
+{
+	const struct allocator *allocs = allocators;
+	size_t nallocs = NALLOCATORS;
+	int fit = 0, opt;
+
+	while ((opt = getopt(argc, argv, "pcs:j:t:")) != -1) {
+		switch (opt) {
+		case 'c':
+			count_misses = 1;
+			break;
+		case 'p':
+			fit = 1;
+			allocs = policies;
+			nallocs = NPOLICIES;
+			break;
+		case 's':
+			scale = atoi(optarg);
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!scale || !nthreads || nthreads > MAX_THREADS)
+		usage(argv[0]);
+
+	printf("%-12s", "");
+	for (size_t i = 0; i < nallocs; i++)
+		printf(" | %-*s", (fit ? 36 : 38) + (count_misses ? 9 : 0),
+			   allocs[i].name);
+	printf("\n%-12s", "benchmark");
+	for (size_t i = 0; i < nallocs; i++) {
+		if (fit)
+			printf(" | %9s %10s %8s %6s", "kops/s", "peak KiB", "free KiB",
+				   "frag %");
+		else
+			printf(" | %9s %8s %8s %10s", "kops/s", "p50 ns", "p99 ns",
+				   "peak KiB");
+
+		if (count_misses)
+			printf(" %8s", "miss/op");
+	}
+	printf("\n");
+
+	for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		if (!bench_selected(&benches[i], argc, argv))
+			continue;
+
+		printf("%-12s", benches[i].name);
+		fflush(stdout);
+
+		for (size_t j = 0; j < nallocs; j++) {
+			struct bench_result res = {0};
+
+			bench_run(&benches[i], &allocs[j], &res);
+			result_print(&res, fit);
+			fflush(stdout);
+		}
+
+		printf("\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "osmem.h"
+#include "helpers.h"
+
+// the chunks of an os_arena are this big, unless os_arena_create() is
+// given a size; BUMP_CHUNK can be set when building
+#ifndef BUMP_CHUNK
+#define BUMP_CHUNK (64 * 1024)
+#endif
+
+#define BUMP_HEADER ((sizeof(struct bump_chunk) + 15) & ~15UL)
+
+
+/* get a chunk of at least "size" bytes of payload from the allocator; a
+ * chunk under the mmap treshold comes from the heap, a bigger one is
+ * mapped, and goes to the mapped chunk cache once it is freed
+ */
+struct bump_chunk *bump_chunk_new(size_t size)
+{
+	struct bump_chunk *c = os_malloc(BUMP_HEADER + size);
+
+	if (!c)
+		return NULL;
+
+	c->next = NULL;
+	c->size = size;
+
+	return c;
+}
+
+/* start allocating from a chunk */
+void bump_use(struct os_arena *arena, struct bump_chunk *c)
+{
+	arena->current = c;
+	arena->ptr = (char *) c + BUMP_HEADER;
+	arena->end = arena->ptr + c->size;
+}
+
+/* move on to the next chunk that can hold "size" bytes: the one after the
+ * current one, if it is big enough and was kept by a reset, or a new one
+ * linked right after the current one; returns 0, or -1 if the memory ran
+ * out
+ */
+int bump_refill(struct os_arena *arena, size_t size)
+{
+	struct bump_chunk *next = arena->current ? arena->current->next :
+							  arena->chunks;
+
+	if (!next || next->size < size) {
+		struct bump_chunk *c = bump_chunk_new(size > arena->chunk_size ?
+											  size : arena->chunk_size);
+
+		if (!c)
+			return -1;
+
+		// a chunk too small for this one stays for the next allocations
+		c->next = next;
+
+		if (arena->current)
+			arena->current->next = c;
+		else
+			arena->chunks = c;
+
+		next = c;
+	}
+
+	bump_use(arena, next);
+
+	return 0;
+}
+
+/* create an arena whose chunks have "chunk_size" bytes, or BUMP_CHUNK if
+ * it is 0; there is no chunk until the first allocation
+ */
+struct os_arena *os_arena_create(size_t chunk_size)
+{
+	if (chunk_size > SIZE_MAX / 2) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	struct os_arena *arena = os_malloc(sizeof(*arena));
+
+	if (!arena)
+		return NULL;
+
+	arena->chunks = NULL;
+	arena->current = NULL;
+	arena->ptr = NULL;
+	arena->end = NULL;
+	arena->chunk_size = chunk_size ? (chunk_size + 15) & ~15UL : BUMP_CHUNK;
+
+	return arena;
+}
+
+/* allocate "size" bytes, aligned to 16, from an arena; they can only be
+ * given back all at once, with os_arena_reset() or os_arena_destroy()
+ */
+void *os_arena_alloc(struct os_arena *arena, size_t size)
+{
+	if (!size)
+		return NULL;
+
+	if (size > SIZE_MAX / 2) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	size = (size + 15) & ~15UL;
+
+	// only moving to another chunk costs more than a compare and an add
+	if (__builtin_expect((size_t) (arena->end - arena->ptr) < size, 0) &&
+		bump_refill(arena, size) == -1)
+		return NULL;
+
+	void *out = arena->ptr;
+
+	arena->ptr += size;
+
+	return out;
+}
+
+/* free everything allocated from an arena, in O(1): its chunks are all
+ * kept, and filled again from the first one
+ */
+void os_arena_reset(struct os_arena *arena)
+{
+	if (arena->chunks)
+		bump_use(arena, arena->chunks);
+}
+
+/* free an arena, with its chunks */
+void os_arena_destroy(struct os_arena *arena)
+{
+	if (!arena)
+		return;
+
+	while (arena->chunks) {
+		struct bump_chunk *next = arena->chunks->next;
+
+		os_free(arena->chunks);
+		arena->chunks = next;
+	}
+
+	os_free(arena);
+}
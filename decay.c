@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <time.h>
+
+#include "osmem.h"
+#include "helpers.h"
+
+// the purge thread wakes up this many times in a decay time, so a page is
+// given back at most this much later than it is due
+#define DECAY_TICKS 4
+
+// decay_ms and decay_now are read without a lock, by the free path and by
+// bin_insert(); the thread and its state are under decay_lock, and
+// decay_set() calls are one at a time, under decay_ctl
+uint64_t decay_ms;
+uint64_t decay_now;
+pthread_mutex_t decay_ctl = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t decay_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t decay_cond = PTHREAD_COND_INITIALIZER;
+pthread_t decay_thread;
+int decay_running;
+int decay_stopping;
+
+
+/* give back what has been free for "age" ms, in every arena and in the
+ * mapped chunk cache; a single arena is locked at a time, so allocations
+ * wait for at most one of them
+ */
+void decay_tick(uint64_t age)
+{
+	uint64_t now = now_ms();
+
+	__atomic_store_n(&decay_now, now, __ATOMIC_RELAXED);
+
+	for (unsigned int i = 0; i < narenas; i++) {
+		pthread_mutex_lock(&arenas[i].lock);
+		arena_decay(&arenas[i], now, age);
+		pthread_mutex_unlock(&arenas[i].lock);
+	}
+
+	mmap_cache_purge(now);
+}
+
+/* tick every decay_ms / DECAY_TICKS, until decay_set(0) */
+void *decay_main(void *arg)
+{
+	(void) arg;
+
+	pthread_mutex_lock(&decay_lock);
+
+	while (!decay_stopping) {
+		uint64_t age = __atomic_load_n(&decay_ms, __ATOMIC_RELAXED);
+		uint64_t wait = age / DECAY_TICKS + 1;
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += wait / 1000;
+		ts.tv_nsec += (wait % 1000) * 1000000L;
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+
+		// a new decay time wakes the thread up early, to wait again
+		if (pthread_cond_timedwait(&decay_cond, &decay_lock, &ts) == 0 ||
+			decay_stopping)
+			continue;
+
+		// the arenas are locked without decay_lock, so a fork() taking
+		// the locks in their order never waits for the thread
+		pthread_mutex_unlock(&decay_lock);
+		decay_tick(__atomic_load_n(&decay_ms, __ATOMIC_RELAXED));
+		pthread_mutex_lock(&decay_lock);
+	}
+
+	pthread_mutex_unlock(&decay_lock);
+
+	return NULL;
+}
+
+/* give back the pages of free blocks from a thread of their own, once they
+ * have been free for "ms" ms, instead of when they are freed; the thread
+ * is started by the first decay time and stopped by 0; returns 1, or 0 if
+ * it cannot be started
+ */
+int decay_set(uint64_t ms)
+{
+	int ret = 1;
+
+	pthread_once(&arenas_once, arenas_init);
+	pthread_mutex_lock(&decay_ctl);
+
+	if (!ms) {
+		__atomic_store_n(&decay_ms, 0, __ATOMIC_RELAXED);
+
+		if (decay_running) {
+			pthread_mutex_lock(&decay_lock);
+			decay_stopping = 1;
+			pthread_cond_signal(&decay_cond);
+			pthread_mutex_unlock(&decay_lock);
+
+			pthread_join(decay_thread, NULL);
+			decay_running = 0;
+			decay_stopping = 0;
+		}
+
+		pthread_mutex_unlock(&decay_ctl);
+
+		return 1;
+	}
+
+	// blocks freed from now on are stamped with a time the thread knows
+	__atomic_store_n(&decay_now, now_ms(), __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&decay_lock);
+	__atomic_store_n(&decay_ms, ms, __ATOMIC_RELAXED);
+	pthread_cond_signal(&decay_cond);
+	pthread_mutex_unlock(&decay_lock);
+
+	// pthread_create() may allocate, so it is called without decay_lock;
+	// the free path purges again if there is no thread
+	if (!decay_running) {
+		if (pthread_create(&decay_thread, NULL, decay_main, NULL) == 0) {
+			decay_running = 1;
+		} else {
+			__atomic_store_n(&decay_ms, 0, __ATOMIC_RELAXED);
+			ret = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&decay_ctl);
+
+	return ret;
+}
+
+/* the child of a fork() has no purge thread, so its free path purges again */
+void decay_fork_child(void)
+{
+	decay_running = 0;
+	decay_stopping = 0;
+	__atomic_store_n(&decay_ms, 0, __ATOMIC_RELAXED);
+}
@@ -4,7 +4,9 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,21 +15,451 @@
 
 #define DIE(assertion, call_description)						\
 	do {										\
-		if (assertion) {							\
-			fprintf(stderr, "(%s, %d): ", __FILE__, __LINE__);		\
-			perror(call_description);					\
-			exit(errno);							\
-		}									\
+		if (assertion)								\
+			die(__FILE__, __LINE__, call_description);			\
 	} while (0)
 
-/* Structure to hold memory block metadata */
+void die(const char *file, int line, const char *call_description);
+void corrupt(const char *what, void *ptr);
+
+/* Structure to hold memory block metadata, 16 bytes, or 32 with the
+ * canary of hardened builds: the heap of an arena is contiguous, so the
+ * block after a heap block starts where it ends and the one before it is
+ * prev_size bytes of payload before it; the flags share a word with the
+ * size, in its low bits; the arena of a heap block is the one its page
+ * belongs to in the page map
+ */
 struct block_meta {
+#ifdef HARDENED
+	// comes first, so an overflow of the block before reaches it first
+	uintptr_t canary;
+#endif
+	// mapped blocks are in no list, they keep how far into their chunk
+	// they start instead, which is not 0 for aligned ones
+	union {
+		size_t prev_size;
+		size_t offset;
+	};
+	size_t status : 2;
+	// set while the payload is known to hold only zeroes
+	size_t zero : 1;
+	// set for mapped blocks backed by MAP_HUGETLB pages
+	size_t huge : 1;
+	// the NUMA node of a mapped block, whose chunk goes back to its cache
+	size_t node : 6;
+	size_t size : 54;
+	// the payload that follows stays 16-aligned, with the canary too
+} __attribute__((aligned(16)));
+
+/* Hardened builds (-DHARDENED) check every header os_free() and
+ * os_realloc() are given against its canary, a secret mixed with its
+ * address, refuse blocks that are free already, and encode the pointers of
+ * the lists linked through freed payloads with the address they are stored
+ * at, like the safe-linking of glibc; a stray write or a double free turns
+ * into an abort, not into a heap that hands out memory it does not own
+ */
+#ifdef HARDENED
+#define HARDEN 1
+#define BLOCK_CANARY(block) (heap_secret ^ (uintptr_t) (block))
+#define BLOCK_SEAL(block) ((block)->canary = BLOCK_CANARY(block))
+#define BLOCK_SEALED(block) ((block)->canary == BLOCK_CANARY(block))
+#define PROTECT(pos, ptr) ((void *) (((uintptr_t) (pos) >> 12) ^			\
+									 (uintptr_t) (ptr)))
+#else
+#define HARDEN 0
+#define BLOCK_SEAL(block) ((void) 0)
+#define BLOCK_SEALED(block) 1
+#define PROTECT(pos, ptr) ((void *) (ptr))
+#endif
+
+#define REVEAL(pos, ptr) PROTECT(pos, ptr)
+
+// every pointer the lists are linked with is 16-aligned
+#define LINK_CHECK(ptr, what)										\
+	do {															\
+		if (HARDEN && ((uintptr_t) (ptr) & 15))						\
+			corrupt(what, ptr);										\
+	} while (0)
+
+extern uintptr_t heap_secret;
+
+/* Number of size classes of the statistics, see size_class(); requests
+ * under SMALLBIN_LIMIT have a class for every multiple of 8, bigger ones
+ * two for every power of two; these are not the bins of the heap
+ */
+#define NSIZE_CLASSES 64
+#define SMALLBIN_LIMIT 256
+
+/* Free heap blocks are kept in bins of two levels, like TLSF: sizes under
+ * BIN_SL * 16 bytes (1 KiB) have a bin for every multiple of 16, and every
+ * power of two over them is cut in BIN_SL bins of the same width (16 bytes
+ * up to 2 KiB, 32 up to 4 KiB, ...), one row of the BIN_FL rows each; the
+ * last bin takes everything that is left, from 2^(BIN_FL + 9) bytes on
+ */
+#define BIN_SL_LOG 6
+#define BIN_SL (1 << BIN_SL_LOG)
+#define BIN_FL 32
+#define NBINS (BIN_FL * BIN_SL)
+
+/* A bin is a dense array of the free blocks of its sizes, in no order, so
+ * a search goes through contiguous entries instead of the headers of the
+ * blocks; it is mapped on its own and grows by doubling; max is at least
+ * the size of its biggest block
+ */
+struct bin_entry {
 	size_t size;
-	int status;
-	struct block_meta *next;
+	struct block_meta *block;
+};
+
+struct bin {
+	struct bin_entry *entries;
+	unsigned int count;
+	unsigned int cap;
+	size_t max;
+};
+
+/* Freed heap blocks of up to FAST_LIMIT bytes can wait in a fast bin, one
+ * for every multiple of 16 over SLAB_MAX, before they are merged
+ */
+#define NFAST 64
+#define FAST_LIMIT (SLAB_MAX + NFAST * 16)
+#define FAST_INDEX(size) (((size) - SLAB_MAX) / 16 - 1)
+
+/* Slabs hold objects of up to SLAB_MAX bytes, in classes of 16 bytes */
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_MAX 1024
+#define SLAB_CLASSES (SLAB_MAX / 16)
+#define SLAB_CLASS(size) (((size) + 15) / 16 - 1)
+#define SLAB_CLASS_SIZE(class) (((class) + 1) * 16)
+
+/* Structure to hold slab metadata, at the start of every slab; a set bit
+ * of free_map marks a free object
+ */
+struct slab {
+	struct slab *next;
+	struct slab *prev;
+	unsigned int arena;
+	unsigned int class;
+	unsigned int size;
+	unsigned int nobjs;
+	unsigned int nfree;
+	unsigned int hint;
+	uint64_t free_map[SLAB_SIZE / 16 / 64];
+};
+
+/* A reserved range of addresses, handed out from its start like a break
+ * and committed as it grows
+ */
+struct region {
+	char *base;
+	char *brk;
+	// end of the committed part, which can be accessed
+	char *commit;
+	// everything from here on is known to be zeroed
+	char *clean;
+	char *end;
+	// whether it may be backed by transparent huge pages
+	int huge;
+	// the NUMA node its pages come from, or -1 for any node
+	int node;
 };
 
+/* Structure to hold an independently locked heap */
+struct arena {
+	pthread_mutex_t lock;
+	// the heap of the arena grows in its own region
+	struct region region;
+	// the NUMA node of the arena, where all of its memory comes from
+	int node;
+	struct block_meta *mem_begin;
+	struct block_meta *mem_end;
+	// a bit for every non-empty bin, and one for every power of two that
+	// has any
+	struct bin bins[NBINS];
+	uint64_t bin_bits[BIN_FL];
+	uint64_t bin_map;
+	// where the next search of OS_FIT_NEXT starts
+	char *next_fit;
+	// LIFO lists of freed blocks that are not merged yet, linked through
+	// their payload, a bitmap of the non-empty ones, and the one the next
+	// merge starts from
+	struct block_meta *fast[NFAST];
+	uint64_t fast_map;
+	unsigned int fast_next;
+	struct slab *slabs[SLAB_CLASSES];
+	// lock-free list of payloads freed by threads of other arenas, on a
+	// cache line of its own
+	void *remote_free __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+extern struct arena arenas[];
+extern unsigned int narenas;
+extern pthread_once_t arenas_once;
+void arenas_init(void);
+void fork_prepare(void);
+void fork_release(void);
+void fork_child(void);
+void fork_init(void);
+struct block_meta *block_next(struct arena *a, struct block_meta *block);
+void arena_decay(struct arena *a, uint64_t now, uint64_t age);
+
+/* A free heap block that is not known to be zeroed keeps the time it was
+ * last written to in the first word of its payload, from decay_now; 0 if
+ * its pages have been given back since, or if the purge thread is not
+ * running
+ */
+#define BLOCK_STAMP(block) (*(uint64_t *) ((block) + 1))
+
+/* and the index of its entry in its bin in the second one, so it is taken
+ * out in O(1); a zeroed block gets a 0 back when it leaves the bin
+ */
+#define BLOCK_SLOT(block) (((uint64_t *) ((block) + 1))[1])
+
 /* Block metadata status values */
 #define STATUS_FREE   0
 #define STATUS_ALLOC  1
 #define STATUS_MAPPED 2
+// freed, but in a fast bin: its neighbours see it as allocated
+#define STATUS_FAST   3
+
+/* Defaults for the cache of freed mapped chunks: at most MMAP_CACHE_MAX
+ * bytes are kept, and chunks older than MMAP_CACHE_DECAY_MS are unmapped
+ */
+#ifndef MMAP_CACHE_MAX
+#define MMAP_CACHE_MAX (64UL * 1024 * 1024)
+#endif
+
+#ifndef MMAP_CACHE_DECAY_MS
+#define MMAP_CACHE_DECAY_MS 10000
+#endif
+
+/* Page map entries: the metadata pointer, with its kind in the low bits;
+ * heap pages point to their arena, slab pages to their slab and the first
+ * payload page of a mapped block to its block_meta
+ */
+#define PAGEMAP_HEAP   1
+#define PAGEMAP_SLAB   2
+#define PAGEMAP_MAPPED 3
+#define PAGEMAP_KIND(entry) ((entry) & 3)
+#define PAGEMAP_PTR(entry) ((void *) ((entry) & ~(uintptr_t) 3))
+
+/* Counters kept by every thread, see stats.c; slab objects, heap blocks and
+ * mapped blocks each have four of them, from STAT_SLAB, STAT_HEAP and
+ * STAT_MAPPED on, and every size class (the classes of the bins) has one,
+ * from STAT_CLASSES on
+ */
+#define STAT_SLAB			0
+#define STAT_HEAP			4
+#define STAT_MAPPED			8
+#define STAT_REALLOC		12
+#define STAT_SPLIT			13
+#define STAT_COALESCE		14
+#define STAT_MMAP			15
+#define STAT_MUNMAP			16
+#define STAT_MREMAP			17
+#define STAT_MMAP_CACHE_HIT	18
+#define STAT_COMMIT			19
+#define STAT_DECOMMIT		20
+#define STAT_PURGE			21
+#define STAT_REMOTE_FREE	22
+#define STAT_TCACHE_REFILL	23
+#define STAT_TCACHE_FLUSH	24
+#define STAT_FAST			25
+#define STAT_CLASSES		26
+#define STAT_COUNT			(STAT_CLASSES + NSIZE_CLASSES)
+
+/* offsets from STAT_SLAB, STAT_HEAP and STAT_MAPPED */
+#define STAT_ALLOCS			0
+#define STAT_FREES			1
+#define STAT_ALLOC_BYTES	2
+#define STAT_FREE_BYTES		3
+
+#define STATS_NEW  0
+#define STATS_LIVE 1
+#define STATS_DEAD 2
+
+struct thread_stats {
+	uint64_t counters[STAT_COUNT];
+	int state;
+	struct thread_stats *next;
+	struct thread_stats *prev;
+};
+
+extern __thread struct thread_stats thread_stats;
+
+/* only the thread itself writes its counters, the relaxed store is there
+ * for the threads that read them; the first update of a thread registers it
+ */
+#define STAT_ADD(stat, n)											\
+	do {															\
+		struct thread_stats *__ts = &thread_stats;					\
+		if (__builtin_expect(__ts->state == STATS_LIVE, 1))			\
+			__atomic_store_n(&__ts->counters[stat],					\
+							 __ts->counters[stat] + (n),				\
+							 __ATOMIC_RELAXED);						\
+		else														\
+			stats_add_slow(stat, n);								\
+	} while (0)
+
+#define STAT_ALLOC(kind, bytes)										\
+	do {															\
+		STAT_ADD((kind) + STAT_ALLOCS, 1);							\
+		STAT_ADD((kind) + STAT_ALLOC_BYTES, bytes);					\
+	} while (0)
+
+#define STAT_FREE(kind, bytes)										\
+	do {															\
+		STAT_ADD((kind) + STAT_FREES, 1);							\
+		STAT_ADD((kind) + STAT_FREE_BYTES, bytes);					\
+	} while (0)
+
+/* a block that changes its size in place */
+#define STAT_RESIZE(kind, old, new)									\
+	do {															\
+		if ((new) > (old))											\
+			STAT_ADD((kind) + STAT_ALLOC_BYTES, (new) - (old));		\
+		else if ((old) > (new))										\
+			STAT_ADD((kind) + STAT_FREE_BYTES, (old) - (new));		\
+	} while (0)
+
+/* stats.c */
+extern pthread_mutex_t stats_lock;
+void stats_add_slow(unsigned int stat, uint64_t n);
+size_t stats_class_size(unsigned int idx);
+void stats_print(const char *fmt, ...);
+
+/* Sampled allocations, see prof.c; a sample keeps up to PROF_DEPTH frames
+ * of the stack it was allocated from, and samples are kept in a table of
+ * PROF_BUCKETS buckets, by address
+ */
+#define PROF_DEPTH 32
+#define PROF_BITS 12
+#define PROF_BUCKETS (1 << PROF_BITS)
+#define PROF_HASH(ptr) ((((uintptr_t) (ptr) >> 4) * 0x9E3779B97F4A7C15ULL) >> \
+						(64 - PROF_BITS))
+
+struct prof_sample {
+	void *ptr;
+	size_t size;
+	int depth;
+	void *frames[PROF_DEPTH];
+	struct prof_sample *next;
+};
+
+extern size_t prof_rate;
+extern __thread int64_t prof_left;
+extern struct prof_sample *prof_table[];
+
+/* the only cost of sampling on the allocation path is the countdown */
+#define PROF_ALLOC(ptr, size)										\
+	do {															\
+		if (__builtin_expect((prof_left -= (int64_t) (size)) < 0, 0))	\
+			prof_sample(ptr, size);									\
+	} while (0)
+
+/* and on the free path, a look at the bucket of the pointer */
+#define PROF_TRACKED(ptr)											\
+	(__atomic_load_n(&prof_table[PROF_HASH(ptr)], __ATOMIC_RELAXED) != NULL)
+
+#define PROF_FREE(ptr)												\
+	do {															\
+		if (PROF_TRACKED(ptr))										\
+			prof_free(ptr);											\
+	} while (0)
+
+/* prof.c */
+extern pthread_mutex_t prof_lock;
+void prof_sample(void *ptr, size_t size);
+struct prof_sample *prof_take(void *ptr);
+void prof_release(struct prof_sample *sample);
+void prof_free(void *ptr);
+void prof_move(struct prof_sample *sample, void *ptr, size_t size);
+void prof_set_rate(size_t rate);
+
+/* Allocation tracing, see trace.c; the entry points record their calls
+ * with TRACE(), which only costs a relaxed load while tracing is off
+ */
+extern int trace_on;
+extern __thread int trace_depth;
+
+#define TRACE(op, ptr, old, size)									\
+	do {															\
+		if (__builtin_expect(__atomic_load_n(&trace_on,				\
+											 __ATOMIC_RELAXED), 0))	\
+			trace_event(op, ptr, old, size);						\
+	} while (0)
+
+/* trace.c */
+extern pthread_mutex_t trace_lock;
+void trace_event(unsigned int op, void *ptr, void *old, size_t size);
+void trace_fork_child(void);
+
+/* A chunk of an os_arena, see bump.c; its payload follows the header */
+struct bump_chunk {
+	struct bump_chunk *next;
+	size_t size;
+};
+
+/* A bump allocator: everything from the first chunk to the current one,
+ * up to ptr, is allocated; the chunks after the current one were kept by
+ * a reset; used by one thread at a time, as nothing in it is locked
+ */
+struct os_arena {
+	struct bump_chunk *chunks;
+	struct bump_chunk *current;
+	char *ptr;
+	char *end;
+	size_t chunk_size;
+};
+
+/* slab.c */
+extern pthread_mutex_t slab_pool_lock;
+struct slab *slab_of(void *ptr);
+size_t slab_bytes(void);
+void *slab_alloc(struct arena *a, unsigned int class);
+void slab_free(struct arena *a, struct slab *s, void *ptr);
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+extern int huge_pages;
+
+/* Most NUMA nodes that are told apart; the others share the last one */
+#define MAX_NODES 64
+
+/* numa.c */
+extern unsigned int numa_nodes;
+void numa_init(void);
+int numa_node_current(void);
+void numa_bind(void *start, size_t len, int node);
+
+/* region.c */
+void region_init(struct region *r, size_t size, int huge);
+void region_bind(struct region *r, int node);
+void *region_grow(struct region *r, size_t len, int *zero);
+void region_shrink(struct region *r, size_t len, int all);
+
+/* pagemap.c */
+extern pthread_mutex_t pagemap_lock;
+void pagemap_set(void *start, size_t len, uintptr_t entry);
+uintptr_t pagemap_get(void *ptr);
+
+/* mmap_cache.c */
+extern pthread_mutex_t mmap_cache_lock;
+uint64_t now_ms(void);
+extern size_t mmap_cache_max;
+extern uint64_t mmap_cache_decay_ms;
+void *mmap_cache_get(size_t *len, int node);
+int mmap_cache_put(void *ptr, size_t len, int node);
+void mmap_cache_set_max(size_t max);
+void mmap_cache_set_decay(uint64_t decay_ms);
+int mmap_cache_flush(void);
+size_t mmap_cache_size(void);
+void mmap_cache_purge(uint64_t now);
+
+/* decay.c */
+extern pthread_mutex_t decay_ctl;
+extern pthread_mutex_t decay_lock;
+extern uint64_t decay_ms;
+extern uint64_t decay_now;
+int decay_set(uint64_t ms);
+void decay_fork_child(void);
@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <time.h>
+
+#include "helpers.h"
+
+#define MMAP_CACHE_BUCKETS 32
+
+
+// a cached chunk keeps its own bookkeeping in its first bytes
+struct mmap_chunk {
+	size_t len;
+	uint64_t time;
+	// the NUMA node its pages come from
+	int node;
+	struct mmap_chunk *next;
+	struct mmap_chunk *prev;
+	struct mmap_chunk *lru_next;
+	struct mmap_chunk *lru_prev;
+};
+
+size_t mmap_cache_max = MMAP_CACHE_MAX;
+uint64_t mmap_cache_decay_ms = MMAP_CACHE_DECAY_MS;
+
+// chunks are bucketed by size, two buckets for every power of two, and
+// also kept in one list from the most to the least recently freed
+struct mmap_chunk *mmap_cache[MMAP_CACHE_BUCKETS];
+struct mmap_chunk *lru_head;
+struct mmap_chunk *lru_tail;
+size_t mmap_cache_bytes;
+pthread_mutex_t mmap_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* get the current time in milliseconds, as cheap as possible */
+uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* map a chunk length to its bucket */
+size_t mmap_cache_bucket(size_t len)
+{
+	size_t log = 63 - __builtin_clzll(len);
+	size_t idx = (log << 1) + ((len >> (log - 1)) & 1);
+
+	// lengths are at least a page, so the first buckets are never used
+	idx = idx < 24 ? 0 : idx - 24;
+
+	return idx < MMAP_CACHE_BUCKETS ? idx : MMAP_CACHE_BUCKETS - 1;
+}
+
+/* take a chunk out of the cache; the cache lock must be held */
+void mmap_cache_remove(struct mmap_chunk *chunk)
+{
+	if (chunk->prev)
+		chunk->prev->next = chunk->next;
+	else
+		mmap_cache[mmap_cache_bucket(chunk->len)] = chunk->next;
+
+	if (chunk->next)
+		chunk->next->prev = chunk->prev;
+
+	if (chunk->lru_prev)
+		chunk->lru_prev->lru_next = chunk->lru_next;
+	else
+		lru_head = chunk->lru_next;
+
+	if (chunk->lru_next)
+		chunk->lru_next->lru_prev = chunk->lru_prev;
+	else
+		lru_tail = chunk->lru_prev;
+
+	mmap_cache_bytes -= chunk->len;
+}
+
+/* unmap the least recently freed chunks, while the cache holds more than
+ * "max" bytes or they are older than the decay time;
+ * the cache lock must be held
+ */
+void mmap_cache_evict(size_t max, uint64_t now)
+{
+	while (lru_tail && (mmap_cache_bytes > max ||
+			now - lru_tail->time >= mmap_cache_decay_ms)) {
+		struct mmap_chunk *chunk = lru_tail;
+
+		mmap_cache_remove(chunk);
+
+		int res = munmap(chunk, chunk->len);
+
+		DIE(res == -1, "munmap failed");
+		STAT_ADD(STAT_MUNMAP, 1);
+	}
+}
+
+/* get a cached chunk of at least *len bytes from the given node, wasting at
+ * most a quarter of it; *len is updated to the length of the chunk
+ */
+void *mmap_cache_get(size_t *len, int node)
+{
+	struct mmap_chunk *best = NULL;
+	size_t idx = mmap_cache_bucket(*len);
+
+	pthread_mutex_lock(&mmap_cache_lock);
+	mmap_cache_evict(mmap_cache_max, now_ms());
+
+	// the chunks of the next bucket are all big enough, but may waste
+	// too much
+	for (size_t i = idx; i <= idx + 1 && i < MMAP_CACHE_BUCKETS; i++) {
+		for (struct mmap_chunk *chunk = mmap_cache[i]; chunk;
+			 chunk = chunk->next) {
+			if (chunk->node == node && chunk->len >= *len &&
+				chunk->len - *len <= *len / 4 &&
+				(!best || chunk->len < best->len))
+				best = chunk;
+		}
+
+		if (best)
+			break;
+	}
+
+	if (best) {
+		mmap_cache_remove(best);
+		*len = best->len;
+	}
+
+	pthread_mutex_unlock(&mmap_cache_lock);
+
+	return best;
+}
+
+/* keep a freed chunk of the given node for later; returns 0 if it does not
+ * fit in the cache and has to be unmapped by the caller
+ */
+int mmap_cache_put(void *ptr, size_t len, int node)
+{
+	struct mmap_chunk *chunk = ptr;
+	size_t idx = mmap_cache_bucket(len);
+
+	pthread_mutex_lock(&mmap_cache_lock);
+
+	if (len > mmap_cache_max) {
+		pthread_mutex_unlock(&mmap_cache_lock);
+		return 0;
+	}
+
+	// make room for the chunk, dropping the oldest ones first
+	chunk->time = now_ms();
+	mmap_cache_evict(mmap_cache_max - len, chunk->time);
+
+	chunk->len = len;
+	chunk->node = node;
+	chunk->prev = NULL;
+	chunk->next = mmap_cache[idx];
+	if (chunk->next)
+		chunk->next->prev = chunk;
+	mmap_cache[idx] = chunk;
+
+	chunk->lru_prev = NULL;
+	chunk->lru_next = lru_head;
+	if (lru_head)
+		lru_head->lru_prev = chunk;
+	else
+		lru_tail = chunk;
+	lru_head = chunk;
+
+	mmap_cache_bytes += len;
+
+	pthread_mutex_unlock(&mmap_cache_lock);
+
+	return 1;
+}
+
+/* change the most bytes the cache holds, unmapping what no longer fits */
+void mmap_cache_set_max(size_t max)
+{
+	pthread_mutex_lock(&mmap_cache_lock);
+	mmap_cache_max = max;
+	mmap_cache_evict(mmap_cache_max, now_ms());
+	pthread_mutex_unlock(&mmap_cache_lock);
+}
+
+/* change how long a chunk is kept, unmapping the ones now too old */
+void mmap_cache_set_decay(uint64_t decay_ms)
+{
+	pthread_mutex_lock(&mmap_cache_lock);
+	mmap_cache_decay_ms = decay_ms;
+	mmap_cache_evict(mmap_cache_max, now_ms());
+	pthread_mutex_unlock(&mmap_cache_lock);
+}
+
+/* unmap the chunks that are too old, for the purge thread, so they go even
+ * when nothing is mapped or unmapped for a while
+ */
+void mmap_cache_purge(uint64_t now)
+{
+	pthread_mutex_lock(&mmap_cache_lock);
+	mmap_cache_evict(mmap_cache_max, now);
+	pthread_mutex_unlock(&mmap_cache_lock);
+}
+
+/* unmap every cached chunk; returns 1 if there were any */
+int mmap_cache_flush(void)
+{
+	pthread_mutex_lock(&mmap_cache_lock);
+
+	int released = lru_tail != NULL;
+
+	mmap_cache_evict(0, now_ms());
+	pthread_mutex_unlock(&mmap_cache_lock);
+
+	return released;
+}
+
+/* get how many bytes the cache holds */
+size_t mmap_cache_size(void)
+{
+	pthread_mutex_lock(&mmap_cache_lock);
+
+	size_t bytes = mmap_cache_bytes;
+
+	pthread_mutex_unlock(&mmap_cache_lock);
+
+	return bytes;
+}
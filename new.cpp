@@ -0,0 +1,155 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <cstdlib>
+#include <new>
+
+#include <malloc.h>
+
+// shim.c exports it, as stdlib.h only declares it from C23 on
+extern "C" void free_sized(void *ptr, std::size_t size) noexcept;
+
+// every block is aligned this much without asking
+#define NEW_ALIGNMENT 16
+
+
+/* operator new has to return a pointer for a size of 0 too, and when
+ * there is no memory, call the new handler until there is or it gives up;
+ * it goes through the functions of shim.c, so that a new from inside the
+ * allocator is served from the bootstrap buffer, and a delete of it is
+ * ignored
+ */
+void *new_alloc(std::size_t size, std::size_t alignment)
+{
+	if (!size)
+		size = 1;
+
+	while (1) {
+		void *ptr = alignment > NEW_ALIGNMENT ? memalign(alignment, size) :
+					malloc(size);
+
+		if (ptr)
+			return ptr;
+
+		std::new_handler handler = std::get_new_handler();
+
+		if (!handler)
+			throw std::bad_alloc();
+
+		handler();
+	}
+}
+
+/* the nothrow versions return NULL instead of throwing */
+void *new_alloc_nothrow(std::size_t size, std::size_t alignment) noexcept
+{
+	try {
+		return new_alloc(size, alignment);
+	} catch (const std::bad_alloc &) {
+		return nullptr;
+	}
+}
+
+void *operator new(std::size_t size)
+{
+	return new_alloc(size, NEW_ALIGNMENT);
+}
+
+void *operator new[](std::size_t size)
+{
+	return new_alloc(size, NEW_ALIGNMENT);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+	return new_alloc_nothrow(size, NEW_ALIGNMENT);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+	return new_alloc_nothrow(size, NEW_ALIGNMENT);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+	return new_alloc(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+	return new_alloc(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment,
+				   const std::nothrow_t &) noexcept
+{
+	return new_alloc_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment,
+					 const std::nothrow_t &) noexcept
+{
+	return new_alloc_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+	free(ptr);
+}
+
+/* sized deletes find slab objects without the page map */
+void operator delete(void *ptr, std::size_t size) noexcept
+{
+	free_sized(ptr, size);
+}
+
+void operator delete[](void *ptr, std::size_t size) noexcept
+{
+	free_sized(ptr, size);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t,
+					 const std::nothrow_t &) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t,
+					   const std::nothrow_t &) noexcept
+{
+	free(ptr);
+}
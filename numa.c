@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "helpers.h"
+
+
+// number of NUMA nodes, from the highest one the system has online; a
+// single node means there is nothing to bind
+unsigned int numa_nodes = 1;
+
+
+/* count the NUMA nodes of the system, from the list of online nodes */
+void numa_init(void)
+{
+	char buf[256];
+	int fd = open("/sys/devices/system/node/online", O_RDONLY);
+
+	// no NUMA support, everything is on one node
+	if (fd == -1)
+		return;
+
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+
+	close(fd);
+
+	if (len <= 0)
+		return;
+
+	// the list looks like "0-1" or "0,2-3"; the nodes are numbered from 0,
+	// so the highest number is all that is needed
+	unsigned int node = 0, max = 0;
+
+	for (ssize_t i = 0; i < len; i++) {
+		if (buf[i] >= '0' && buf[i] <= '9') {
+			node = node * 10 + buf[i] - '0';
+		} else {
+			max = node > max ? node : max;
+			node = 0;
+		}
+	}
+
+	max = node > max ? node : max;
+	numa_nodes = max + 1 > MAX_NODES ? MAX_NODES : max + 1;
+}
+
+/* get the node the calling thread is running on */
+int numa_node_current(void)
+{
+	unsigned int cpu, node;
+
+	if (numa_nodes == 1 || syscall(SYS_getcpu, &cpu, &node, NULL) == -1)
+		return 0;
+
+	return node < numa_nodes ? (int) node : (int) numa_nodes - 1;
+}
+
+/* ask for the pages of a range to come from the given node */
+void numa_bind(void *start, size_t len, int node)
+{
+	unsigned long mask[MAX_NODES / 64] = {0};
+
+	if (numa_nodes == 1 || node < 0)
+		return;
+
+	mask[node / 64] = 1UL << (node % 64);
+
+	// this fails if the kernel has no NUMA support, the memory can
+	// still be used
+	syscall(SYS_mbind, start, len, MPOL_PREFERRED, mask, MAX_NODES + 1, 0);
+}
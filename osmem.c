@@ -1,415 +1,2733 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+// for mremap()
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sys/auxv.h>
+
 #include "osmem.h"
 #include "helpers.h"
+#include "trace.h"
 
 #define MMAP_THRESHOLD (128 * 1024)
-#define ALIGN8(size) (((size) + 7) & ~7)
-#define SIZEOF_STRUCT_BLOCK_META ALIGN8(sizeof(struct block_meta))
+#define ALIGNMENT 16
+#define ALIGN16(size) (((size) + 15) & ~15)
+#define ALIGN_UP(addr, alignment) (((addr) + (alignment) - 1) & \
+								   ~((uintptr_t) (alignment) - 1))
+#define SIZEOF_STRUCT_BLOCK_META ALIGN16(sizeof(struct block_meta))
+#define PAGE_ALIGN(size) (((size) + getpagesize() - 1) & \
+							~((size_t) getpagesize() - 1))
+#define PAGE_TRUNC(size) ((size) & ~((size_t) getpagesize() - 1))
+#define MIN_PAYLOAD ALIGNMENT
+
+#define MAX_ARENAS 64
+
+// the heap of every arena can grow this much, ARENA_REGION can be set
+// when building
+#ifndef ARENA_REGION
+#define ARENA_REGION (16UL * 1024 * 1024 * 1024)
+#endif
+
+#define BLOCK_END(block) ((struct block_meta *) ((char *) (block) + \
+							SIZEOF_STRUCT_BLOCK_META + (block)->size))
+
+// a heap block in use that holds its canary needs nothing more from
+// block_verify(), so a hardened free only calls it for the other blocks
+#define BLOCK_VERIFY(block, entry)										\
+	do {																\
+		if (HARDEN && (entry) && PAGEMAP_KIND(entry) != PAGEMAP_SLAB &&	\
+			(PAGEMAP_KIND(entry) != PAGEMAP_HEAP ||						\
+			 (block)->status != STATUS_ALLOC || !BLOCK_SEALED(block)))	\
+			block_verify(block, entry);									\
+	} while (0)
+
+#define TCACHE_COUNT 32
+
+// a bin has room for this many entries when it is first mapped
+#define BIN_ENTRIES (4096 / sizeof(struct bin_entry))
+
+#define MMAP_THRESHOLD_MAX (32 * 1024 * 1024)
+#define TRIM_THRESHOLD (128 * 1024)
+
+// what a free top of the heap keeps when it is trimmed on free, like
+// M_TOP_PAD; it can be set when building
+#ifndef TOP_PAD
+#define TOP_PAD (128 * 1024)
+#endif
+
+#define HUGE_ALIGN(size) (((size) + HUGE_PAGE_SIZE - 1) & \
+						  ~((size_t) HUGE_PAGE_SIZE - 1))
+#define HUGE_TRUNC(size) ((size) & ~((size_t) HUGE_PAGE_SIZE - 1))
+
+// huge pages are off by default, HUGE_PAGES can be set when building
+#ifndef HUGE_PAGES
+#define HUGE_PAGES OS_HUGE_OFF
+#endif
+
+// the placement policy, and the smallest payload a split leaves free: a
+// heap block only serves sizes over SLAB_MAX, so anything smaller could
+// only be reused once it merges; both can be set when building
+#ifndef FIT_POLICY
+#define FIT_POLICY OS_FIT_BEST
+#endif
+
+#ifndef SPLIT_MIN
+#define SPLIT_MIN (SLAB_MAX + ALIGNMENT)
+#endif
+
+// freed heap blocks of up to FAST_MAX bytes wait in the fast bins, and
+// FAST_MERGE of them are merged on every allocation the fast bins miss;
+// both can be set when building
+#ifndef FAST_MAX
+#define FAST_MAX FAST_LIMIT
+#endif
+
+#ifndef FAST_MERGE
+#define FAST_MERGE 2
+#endif
+
+
+// every arena holds its own list of blocks, with mem_begin and mem_end,
+// its segregated free lists, one for every size class, and a bitmap that
+// has a bit set for every non-empty bin; an arena is protected by its
+// lock, and only refills and flushes of the thread caches take it
+struct arena arenas[MAX_ARENAS];
+unsigned int narenas;
+unsigned int next_arena;
+pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+
+// threads are assigned round-robin to the arenas of the NUMA node they run
+// on, when they first need one
+__thread struct arena *thread_arena;
+
+// per-thread cache of slab objects, one LIFO list for every slab class;
+// cached objects are linked through their first word and are still
+// allocated as far as their slab knows
+struct tcache {
+	void *entries[SLAB_CLASSES];
+	unsigned int count[SLAB_CLASSES];
+	int registered;
+	int disabled;
+};
+
+__thread struct tcache tcache;
+pthread_key_t tcache_key;
+pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+// the mmap tresholds of os_malloc() and os_calloc(); they start at
+// MMAP_THRESHOLD and the page size (a calloc_threshold of 0) and follow
+// the freed mapped chunks up to MMAP_THRESHOLD_MAX, until os_mallopt()
+// sets them
+size_t mmap_threshold = MMAP_THRESHOLD;
+size_t calloc_threshold;
+int mmap_threshold_fixed;
+int calloc_threshold_fixed;
+
+// free memory of at least trim_threshold bytes is given back to the
+// system; it is kept at twice the malloc treshold, until os_mallopt() sets it
+size_t trim_threshold = TRIM_THRESHOLD;
+int trim_threshold_fixed;
+
+// a free top that reaches trim_threshold keeps top_pad bytes, so a heap
+// that shrinks and grows back by a little does not fault its pages in
+// again every time
+size_t top_pad = TOP_PAD;
+
+// whether big mappings use huge pages: OS_HUGE_THP asks for transparent
+// huge pages, OS_HUGE_TLB also tries MAP_HUGETLB pages for mapped blocks
+int huge_pages = HUGE_PAGES;
+
+// how find_best_block() picks a free block, see os_mallopt(OS_M_FIT_POLICY),
+// and the smallest free block split_block() may leave, at least MIN_PAYLOAD
+int fit_policy = FIT_POLICY;
+size_t split_min = SPLIT_MIN < MIN_PAYLOAD ? MIN_PAYLOAD : ALIGN16(SPLIT_MIN);
+
+// the biggest block that goes to a fast bin when it is freed, at most
+// FAST_LIMIT, or 0 to merge every block right away
+size_t fast_max = FAST_MAX > FAST_LIMIT ? FAST_LIMIT : FAST_MAX;
+
+// random secrets of hardened builds: the canary of a header is heap_secret
+// mixed with its address, and the objects of a thread cache hold
+// tcache_secret in their second word, so freeing one again is noticed
+uintptr_t heap_secret;
+uintptr_t tcache_secret;
+
+
+/* report a failed call and exit, with write() only: this can run inside a
+ * call to malloc() of a program the allocator was preloaded into, where
+ * stdio may allocate, and the handlers of exit() may free
+ */
+void die(const char *file, int line, const char *call_description)
+{
+	char buf[256];
+	int err = errno;
+	int len = snprintf(buf, sizeof(buf), "(%s, %d): %s: errno %d\n", file,
+					   line, call_description, err);
 
+	if (len > (int) sizeof(buf) - 1)
+		len = sizeof(buf) - 1;
 
-void *mem_begin;
-struct block_meta *mem_end;
+	// nothing can be done if stderr is gone
+	if (len > 0)
+		len = write(STDERR_FILENO, buf, len);
 
+	_exit(err);
+}
 
-/* split the given block */
-void split_block(struct block_meta *block, size_t size)
+/* report a corrupted header or list, or a pointer that cannot be freed,
+ * and abort, in hardened builds; like die(), with write() only
+ */
+void corrupt(const char *what, void *ptr)
 {
-	// align the new size
-	size_t new_size_aligned = ALIGN8(size + SIZEOF_STRUCT_BLOCK_META);
+	char buf[128];
+	int len = snprintf(buf, sizeof(buf), "osmem: %s: %p\n", what, ptr);
 
-	// access the position where the newly created block should be;
-	// a cast to (char *) is needed and after that we can just add
-	// the new size as an offset;
-	struct block_meta *temp = block->next;
-	struct block_meta *second_part = (struct block_meta *)
-									((char *) block + new_size_aligned);
+	if (len > (int) sizeof(buf) - 1)
+		len = sizeof(buf) - 1;
 
-	// add the struct to the list and fill the info needed
-	second_part->next = temp;
-	second_part->size = ALIGN8(block->size - new_size_aligned);
-	second_part->status = STATUS_FREE;
-	block->next = second_part;
-	block->size = ALIGN8(size);
+	if (len > 0)
+		len = write(STDERR_FILENO, buf, len);
 
-	// update the end of the list if the last block was in need of a split
-	if (mem_end == block)
-		mem_end = second_part;
+	abort();
 }
 
-/* merge multiple blocks */
-void coalesce_blocks(void)
+/* set up the arena locks, one arena for every online cpu, and spread the
+ * arenas over the NUMA nodes
+ */
+void arenas_init(void)
 {
-	// get the list head
-	struct block_meta *curr = mem_begin;
-	struct block_meta *temp = NULL;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	numa_init();
 
-	// while both the current and the next block are free, merge them;
-	// if a merge has been made, attempt to only change the next block and
-	// check if it is free as well; if that is the case, continue the merge
-	// process;
-	while (curr && curr->next) {
-		if (curr->status == STATUS_FREE && curr->next->status == STATUS_FREE) {
-			// use a temporary variable to store the block that is going to
-			// not appear in the list anymore
-			temp = curr->next;
-			curr->next = curr->next->next;
-			// update the size of the current by adding the size
-			// of the former node and the size of the block_meta struct,
-			// as that counts as available space as well
-			curr->size += temp->size + SIZEOF_STRUCT_BLOCK_META;
-			curr->size = ALIGN8(curr->size);
-		} else
-			// if one of the blocks checked is not free, then update the
-			// current node and repeat the process
-			curr = curr->next;
+	// the kernel hands every process 16 random bytes, not always aligned
+	if (HARDEN) {
+		char *random = (char *) getauxval(AT_RANDOM);
+
+		heap_secret = (uintptr_t) &heap_secret;
+		tcache_secret = ~heap_secret;
+
+		if (random) {
+			memcpy(&heap_secret, random, sizeof(heap_secret));
+			memcpy(&tcache_secret, random + sizeof(heap_secret),
+				   sizeof(tcache_secret));
+		}
 	}
 
-	// try to update the last block, if anything changed over there
-	curr = mem_begin;
-	while (curr && curr->next)
-		curr = curr->next;
+	// every node gets the same number of arenas, at least one
+	narenas = ncpu < 1 ? 1 : ncpu > MAX_ARENAS ? MAX_ARENAS : ncpu;
+	narenas = (narenas + numa_nodes - 1) / numa_nodes * numa_nodes;
+
+	if (narenas > MAX_ARENAS)
+		narenas = MAX_ARENAS / numa_nodes * numa_nodes;
 
-	mem_end = curr;
+	for (unsigned int i = 0; i < narenas; i++) {
+		pthread_mutex_init(&arenas[i].lock, NULL);
+		arenas[i].node = i % numa_nodes;
+	}
 }
 
-/* algorithm to find the best fitting block in the list */
-struct block_meta *find_best_block(size_t size)
+/* fork() may happen while another thread holds a lock of the allocator: it
+ * is taken around the fork, so the child gets every lock free and every
+ * list whole; the order is the one they nest in
+ */
+void fork_prepare(void)
 {
-	// begin search from the head
-	if (!mem_begin)
-		return NULL;
+	pthread_once(&arenas_once, arenas_init);
 
-	// merge the free blocks
-	coalesce_blocks();
-
-	struct block_meta *curr = mem_begin;
-
-	// if there is at least a block in the list, initialize the result
-	// with the first block in the list (and check if it is free to use!)
-	size_t best_fit_size = curr->size;
-	struct block_meta *best = curr;
-	size_t can_be_used = best->status == STATUS_FREE ? 1 : 0;
-
-	// we search for the block that fits our size best;
-	// for that, we iterate through the whole list
-	while (curr) {
-		if (curr->status == STATUS_FREE && curr->size >= size &&
-			// this last condition is needed because:
-			// 1. if we find a block with a better fit than the best found size
-			// until now, we can update the best block
-			// 2. if we find a block with a worse fit than the best found size
-			// until now, we need to see if the block that had that best size
-			// can be used; if not, we can update the best block
-			(curr->size < best_fit_size || can_be_used == 0)) {
-			best = curr;
-			best_fit_size = curr->size;
-			// this block can for sure be used
-			can_be_used = 1;
-		}
+	pthread_mutex_lock(&decay_ctl);
+	pthread_mutex_lock(&prof_lock);
 
-		curr = curr->next;
-	}
+	for (unsigned int i = 0; i < narenas; i++)
+		pthread_mutex_lock(&arenas[i].lock);
 
-	size_t size_aligned = ALIGN8(size + SIZEOF_STRUCT_BLOCK_META);
+	pthread_mutex_lock(&mmap_cache_lock);
+	pthread_mutex_lock(&slab_pool_lock);
+	pthread_mutex_lock(&pagemap_lock);
+	pthread_mutex_lock(&stats_lock);
+	pthread_mutex_lock(&trace_lock);
+	pthread_mutex_lock(&decay_lock);
+}
 
-	// if we have found a block we can use, check if it needs to be split
-	if (can_be_used == 1 && best->size > size_aligned)
-		split_block(best, size);
+void fork_release(void)
+{
+	pthread_mutex_unlock(&decay_lock);
+	pthread_mutex_unlock(&trace_lock);
+	pthread_mutex_unlock(&stats_lock);
+	pthread_mutex_unlock(&pagemap_lock);
+	pthread_mutex_unlock(&slab_pool_lock);
+	pthread_mutex_unlock(&mmap_cache_lock);
+
+	for (unsigned int i = narenas; i > 0; i--)
+		pthread_mutex_unlock(&arenas[i - 1].lock);
+
+	pthread_mutex_unlock(&prof_lock);
+	pthread_mutex_unlock(&decay_ctl);
+}
 
-	// if we have found a block we can use, return it
-	return can_be_used == 1 ? best : NULL;
+void fork_child(void)
+{
+	trace_fork_child();
+	decay_fork_child();
+	fork_release();
 }
 
+/* register the fork handlers when the library is loaded, whether it takes
+ * over malloc() or only the os_*() functions are called
+ */
+__attribute__((constructor))
+void fork_init(void)
+{
+	pthread_atfork(fork_prepare, fork_release, fork_child);
+}
 
-/* create a new memory block */
-struct block_meta *create_block(size_t size, size_t treshold)
+/* get the arena of the calling thread */
+struct arena *arena_get(void)
 {
-	struct block_meta *new_block = NULL;
+	if (!thread_arena) {
+		pthread_once(&arenas_once, arenas_init);
 
-	// if the given size is smaller than the treshold value, use sbrk;
-	// otherwise, use mmap
-	if (ALIGN8(size) < treshold) {
-		// source: man sbrk;
-		// increase heap size by calling sbrk(size + SIZEOF_STRUCT_BLOCK_META);
+		// arena i is on node i % numa_nodes
+		unsigned int node = numa_node_current();
+		unsigned int next = __atomic_fetch_add(&next_arena, 1,
+											   __ATOMIC_RELAXED);
 
-		new_block = sbrk(ALIGN8(size + SIZEOF_STRUCT_BLOCK_META));
+		thread_arena = &arenas[node + next % (narenas / numa_nodes) *
+							   numa_nodes];
+	}
 
-		// check the error code
-		DIE(new_block == (void *) -1, "sbrk failed");
-		new_block->status = STATUS_ALLOC;
+	return thread_arena;
+}
 
-	} else {
-		// allocate independent memory chunk
-		new_block = mmap(NULL, ALIGN8(size + SIZEOF_STRUCT_BLOCK_META),
-				PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-		// check the error code
-		DIE(new_block == MAP_FAILED, "map failed");
-		new_block->status = STATUS_MAPPED;
-	}
+/* map a size asked for to its class in the statistics */
+size_t size_class(size_t size)
+{
+	// small sizes get an exact class for every multiple of 8
+	if (size < SMALLBIN_LIMIT)
+		return size >> 3;
 
-	// align the new block's size and set the next value to NULL
-	new_block->size = ALIGN8(size);
-	new_block->next = NULL;
+	// bigger sizes get two classes for every power of two, the last one
+	// taking everything that is left
+	size_t log = 63 - __builtin_clzll(size);
+	size_t idx = 32 + ((log - 8) << 1) + ((size >> (log - 1)) & 1);
 
-	return new_block;
+	return idx < NSIZE_CLASSES ? idx : NSIZE_CLASSES - 1;
 }
 
+/* map the size of a free block, a multiple of 16, to the index of its bin */
+size_t bin_index(size_t size)
+{
+	// small sizes get an exact bin for every multiple of 16
+	if (size < BIN_SL * 16)
+		return size >> 4;
 
-/* alloc a number of bytes on the heap when first using it */
-struct block_meta *prealloc(void)
+	// the bin of a bigger size is the power of two it is in, then the
+	// BIN_SL_LOG bits right after its top one
+	size_t log = 63 - __builtin_clzll(size);
+	size_t fl = log - (BIN_SL_LOG + 4) + 1;
+
+	if (fl >= BIN_FL)
+		return NBINS - 1;
+
+	return fl * BIN_SL + ((size >> (log - BIN_SL_LOG)) & (BIN_SL - 1));
+}
+
+/* find the first non-empty bin from "idx" on, with the bitmaps of both
+ * levels; returns NBINS if there is none
+ */
+size_t bin_next(struct arena *a, size_t idx)
 {
-	// create a new block of MMAP_THRESHOLD size
-	struct block_meta *new_block = create_block(MMAP_THRESHOLD -
-									SIZEOF_STRUCT_BLOCK_META, MMAP_THRESHOLD);
+	if (idx >= NBINS)
+		return NBINS;
 
-	if (!new_block)
-		return NULL;
+	size_t fl = idx / BIN_SL;
+	uint64_t map = a->bin_bits[fl] & (~0ULL << (idx % BIN_SL));
 
-	// initialize the list
-	mem_begin = new_block;
-	mem_end = mem_begin;
+	if (map)
+		return fl * BIN_SL + __builtin_ctzll(map);
 
-	// return the payload
-	return (new_block + 1);
+	map = a->bin_map & (~0ULL << (fl + 1));
+
+	if (!map)
+		return NBINS;
+
+	fl = __builtin_ctzll(map);
+
+	return fl * BIN_SL + __builtin_ctzll(a->bin_bits[fl]);
 }
 
+/* make room for more entries in a bin; returns -1 if there is no memory
+ * left
+ */
+int bin_grow(struct bin *b)
+{
+	size_t cap = b->cap ? 2 * (size_t) b->cap : BIN_ENTRIES;
+	void *entries;
+
+	if (b->entries)
+		entries = mremap(b->entries, b->cap * sizeof(*b->entries),
+						 cap * sizeof(*b->entries), MREMAP_MAYMOVE);
+	else
+		entries = mmap(NULL, cap * sizeof(*b->entries),
+					   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+					   -1, 0);
 
-/* auxiliary malloc function that takes
- * a treshold value as an extra parameter
+	if (entries == MAP_FAILED)
+		return -1;
+
+	b->entries = entries;
+	b->cap = cap;
+
+	return 0;
+}
+
+/* add a free block to its bin; a block there is no memory left to index
+ * stays out of the bins, it is still merged with its neighbours
  */
-void *os_malloc_aux(size_t size, size_t treshold)
+void bin_insert(struct arena *a, struct block_meta *block)
 {
-	// early exit case
-	if (size <= 0)
-		return NULL;
+	size_t idx = bin_index(block->size);
+	struct bin *b = &a->bins[idx];
 
-	// align the size
-	size_t size_aligned = ALIGN8(size);
-	// get a new block that will hold the memory
-	struct block_meta *new_block = NULL;
+	// the pages of a dirty block wait for the purge thread from now on
+	if (!block->zero)
+		BLOCK_STAMP(block) = __atomic_load_n(&decay_now, __ATOMIC_RELAXED);
 
-	// check the existing memory list for a fitting value if the size it needs
-	// is small enough to be allocated with sbrk
-	if (mem_begin && size_aligned < treshold) {
-		new_block = find_best_block(size_aligned);
+	if (b->count == b->cap && bin_grow(b) == -1)
+		return;
 
-		if (new_block) {
-			// if we have found a block, mark it as allocated and return
-			// the payload, that is adding 1 to the block_meta struct
-			new_block->status = STATUS_ALLOC;
-			return (new_block + 1);
-		}
-	}
+	// the entry goes at the end and the block remembers where it is
+	b->entries[b->count].size = block->size;
+	b->entries[b->count].block = block;
+	BLOCK_SLOT(block) = b->count++;
 
-	// if we have not found a fitting block in the list, we can check
-	// the last block to see if it is free and, if so, expand it and use it
-	if (mem_end && mem_end->status == STATUS_FREE &&
-		mem_end->size < size_aligned &&
-		size_aligned < treshold - SIZEOF_STRUCT_BLOCK_META) {
-		// get more space by computing the needed extra size
-		struct block_meta *res = sbrk(ALIGN8(size_aligned - mem_end->size));
+	if (block->size > b->max)
+		b->max = block->size;
 
-		// check the error code
-		DIE(res == (void *) -1, "sbrk failed");
+	a->bin_bits[idx / BIN_SL] |= 1ULL << (idx % BIN_SL);
+	a->bin_map |= 1ULL << (idx / BIN_SL);
+}
+
+/* take a free block out of its bin; the block size must not have
+ * been changed since it was inserted
+ */
+void bin_remove(struct arena *a, struct block_meta *block)
+{
+	size_t idx = bin_index(block->size);
+	struct bin *b = &a->bins[idx];
+	uint64_t i = BLOCK_SLOT(block);
+
+	// a block that could not be indexed is not there
+	if (i >= b->count || b->entries[i].block != block)
+		return;
+
+	// the last entry takes its place
+	b->entries[i] = b->entries[--b->count];
+	BLOCK_SLOT(b->entries[i].block) = i;
+
+	if (block->zero)
+		BLOCK_SLOT(block) = 0;
 
-		mem_end->size = ALIGN8(size_aligned);
-		mem_end->status = STATUS_ALLOC;
-		return mem_end + 1;
+	// clear the bitmap bits once the bin runs empty
+	if (!b->count) {
+		b->max = 0;
+		a->bin_bits[idx / BIN_SL] &= ~(1ULL << (idx % BIN_SL));
+
+		if (!a->bin_bits[idx / BIN_SL])
+			a->bin_map &= ~(1ULL << (idx / BIN_SL));
 	}
+}
 
-	// if the list has not been used yet, prealloc memory on heap
-	if (size_aligned < treshold - SIZEOF_STRUCT_BLOCK_META && !mem_begin)
-		return prealloc();
 
-	// if none of the above cases were a match, create the block, at last
-	new_block = create_block(size_aligned,
-							treshold - SIZEOF_STRUCT_BLOCK_META);
-	if (!new_block)
+/* get the block after a heap block, or NULL for the last one */
+struct block_meta *block_next(struct arena *a, struct block_meta *block)
+{
+	return block == a->mem_end ? NULL : BLOCK_END(block);
+}
+
+/* get the block before a heap block, or NULL for the first one */
+struct block_meta *block_prev(struct arena *a, struct block_meta *block)
+{
+	if (block == a->mem_begin)
 		return NULL;
 
-	// we requested a new block so we update the list if sbrk() was used
-	if (new_block->status == STATUS_ALLOC) {
-		mem_end->next = new_block;
-		mem_end = new_block;
+	return (struct block_meta *) ((char *) block - block->prev_size -
+								  SIZEOF_STRUCT_BLOCK_META);
+}
+
+/* tell the block after a heap block the size it has now */
+void block_link(struct arena *a, struct block_meta *block)
+{
+	if (block != a->mem_end)
+		BLOCK_END(block)->prev_size = block->size;
+}
+
+/* merge a free block, that is not in a bin, with its free neighbours;
+ * returns the merged block
+ */
+struct block_meta *coalesce_blocks(struct arena *a, struct block_meta *block)
+{
+	struct block_meta *next = block_next(a, block);
+	struct block_meta *prev = block_prev(a, block);
+
+	// an overflow out of the block, or into it, has hit a neighbour
+	if (HARDEN && next && !BLOCK_SEALED(next))
+		corrupt("corrupted header after", block + 1);
+
+	if (HARDEN && prev && !BLOCK_SEALED(prev))
+		corrupt("corrupted header before", block + 1);
+
+	// no two neighbours are ever both free, so a single merge in each
+	// direction is all that is needed; the merged block takes over the
+	// space of the block_meta struct as well
+	if (next && next->status == STATUS_FREE) {
+		STAT_ADD(STAT_COALESCE, 1);
+		bin_remove(a, next);
+		block->zero = 0;
+		block->size = block->size + next->size + SIZEOF_STRUCT_BLOCK_META;
+
+		// update the end of the list if we have merged the last block
+		if (a->mem_end == next)
+			a->mem_end = block;
 	}
 
-	// return the payload
-	return (new_block + 1);
+	if (prev && prev->status == STATUS_FREE) {
+		STAT_ADD(STAT_COALESCE, 1);
+		bin_remove(a, prev);
+		prev->zero = 0;
+		prev->size = prev->size + block->size + SIZEOF_STRUCT_BLOCK_META;
+
+		if (a->mem_end == block)
+			a->mem_end = prev;
+
+		block = prev;
+	}
+
+	block_link(a, block);
+
+	return block;
 }
 
+/* split the given block */
+void split_block(struct arena *a, struct block_meta *block, size_t size)
+{
+	// align the new size
+	size_t new_size_aligned = ALIGN16(size + SIZEOF_STRUCT_BLOCK_META);
 
-/* calls os_malloc_aux with MMAP_THRESHOLD as treshold value */
-void *os_malloc(size_t size)
+	// access the position where the newly created block should be;
+	// a cast to (char *) is needed and after that we can just add
+	// the new size as an offset;
+	struct block_meta *second_part = (struct block_meta *)
+									((char *) block + new_size_aligned);
+
+	STAT_ADD(STAT_SPLIT, 1);
+
+	// fill the info needed; the second part starts where the first one
+	// now ends, so it is in the list already
+	*second_part = (struct block_meta) {
+		.prev_size = ALIGN16(size),
+		.status = STATUS_FREE,
+		.zero = block->zero,
+		.size = block->size - new_size_aligned,
+	};
+	BLOCK_SEAL(second_part);
+	block->size = ALIGN16(size);
+
+	// update the end of the list if the last block was in need of a split
+	if (a->mem_end == block)
+		a->mem_end = second_part;
+
+	// the second part is free, so it can be found by find_best_block();
+	// merge it first, in case the block after it was free as well
+	bin_insert(a, coalesce_blocks(a, second_part));
+}
+
+/* whether splitting a block for "size" bytes leaves a free block worth
+ * having: one of at least split_min bytes, or any at the end of the heap,
+ * which grows into it
+ */
+int split_fits(struct arena *a, struct block_meta *block, size_t size)
 {
-	/* TODO: Implement os_malloc */
-	return os_malloc_aux(size, MMAP_THRESHOLD);
+	size_t size_aligned = ALIGN16(size + SIZEOF_STRUCT_BLOCK_META);
+	size_t min = block == a->mem_end ? MIN_PAYLOAD :
+				 __atomic_load_n(&split_min, __ATOMIC_RELAXED);
+
+	return block->size >= size_aligned + min;
 }
 
+/* search a bin for the smallest block of at least "size" bytes, going
+ * through its sizes only; a block of that very size ends the search; a
+ * search that finds none lowers max to the biggest size it has seen, so
+ * the next one for this size is not made
+ */
+struct block_meta *bin_fit(struct bin *b, size_t size)
+{
+	struct bin_entry *best = NULL;
+	size_t max = 0;
+
+	if (b->max < size)
+		return NULL;
 
-/* calls os_malloc_aux with page_size as treshold value
- * and sets every byte to 0
+	for (unsigned int i = 0; i < b->count; i++) {
+		struct bin_entry *e = &b->entries[i];
+
+		if (e->size == size)
+			return e->block;
+
+		if (e->size > size && (!best || e->size < best->size))
+			best = e;
+
+		if (e->size > max)
+			max = e->size;
+	}
+
+	if (best)
+		return best->block;
+
+	b->max = max;
+
+	return NULL;
+}
+
+/* best fit: the smallest free block that fits; sizes under 2 KiB have
+ * bins of a single size, so any block of their own bin is the best fit
  */
-void *os_calloc(size_t nmemb, size_t size)
+struct block_meta *fit_best(struct arena *a, size_t size)
 {
-	/* TODO: Implement os_calloc */
+	size_t idx = bin_index(size);
+	struct bin *b = &a->bins[idx];
+	struct block_meta *block;
 
-	// get the page size
-	long page_size = getpagesize();
+	if (size < 2 * BIN_SL * 16)
+		block = b->count ? b->entries[b->count - 1].block : NULL;
+	else
+		block = bin_fit(b, size);
 
-	void *out = os_malloc_aux(nmemb * size, page_size);
+	if (block)
+		return block;
 
-	// set bytes to 0
-	memset((void *) out, 0, nmemb * size);
-	return out;
+	// otherwise, every block of the next non-empty bin fits our size, and
+	// the smallest of them is the best fit
+	idx = bin_next(a, idx + 1);
+
+	return idx < NBINS ? bin_fit(&a->bins[idx], size) : NULL;
 }
 
-/* change the size of the memory block to "size" bytes */
-void *os_realloc(void *ptr, size_t size)
+/* good fit: the last block of the first bin whose last block fits, so a bin
+ * is only searched when no bigger one has a block; what it finds is the
+ * best fit, or a block of the bin after it
+ */
+struct block_meta *fit_good(struct arena *a, size_t size)
 {
-	/* TODO: Implement os_realloc */
+	size_t idx = bin_index(size);
+	struct bin *b = &a->bins[idx];
 
-	// early exit cases
-	if (ptr == NULL)
-		return os_malloc(size);
+	if (b->count && b->entries[b->count - 1].size >= size)
+		return b->entries[b->count - 1].block;
 
-	if (size == 0) {
-		os_free(ptr);
+	size_t next = bin_next(a, idx + 1);
+
+	return next < NBINS ? a->bins[next].entries[a->bins[next].count - 1].block :
+		   fit_best(a, size);
+}
+
+/* address-ordered fit: the free block that fits with the lowest address
+ * from "from" on, or the lowest one before it if there is none; it looks
+ * at every free block that fits, in the bins from the one of size up
+ */
+struct block_meta *fit_address(struct arena *a, size_t size, char *from)
+{
+	struct block_meta *after = NULL, *before = NULL;
+
+	for (size_t idx = bin_next(a, bin_index(size)); idx < NBINS;
+		 idx = bin_next(a, idx + 1)) {
+		struct bin *b = &a->bins[idx];
+
+		for (unsigned int i = 0; i < b->count; i++) {
+			struct block_meta *curr = b->entries[i].block;
+
+			if (b->entries[i].size < size)
+				continue;
+
+			if ((char *) curr >= from) {
+				if (!after || curr < after)
+					after = curr;
+			} else if (!before || curr < before) {
+				before = curr;
+			}
+		}
+	}
+
+	return after ? after : before;
+}
+
+/* take a free block for "size" bytes out of the bins, with the placement
+ * policy of fit_policy, and split what it does not need off
+ */
+struct block_meta *find_best_block(struct arena *a, size_t size)
+{
+	// begin search from the head
+	if (!a->mem_begin)
 		return NULL;
+
+	int policy = __atomic_load_n(&fit_policy, __ATOMIC_RELAXED);
+	struct block_meta *best;
+
+	switch (policy) {
+	case OS_FIT_GOOD:
+		best = fit_good(a, size);
+		break;
+	case OS_FIT_FIRST:
+		best = fit_address(a, size, NULL);
+		break;
+	case OS_FIT_NEXT:
+		// a rover that was merged away, or trimmed, is still a valid
+		// place to start from
+		best = fit_address(a, size, a->next_fit);
+		break;
+	default:
+		best = fit_best(a, size);
 	}
 
-	// get the block_meta structure from the given pointer;
-	// to do that, we need to cast the pointer and after that
-	// substract 1, as ptr is only the payload and we have to
-	// extract the metadata as well;
-	struct block_meta *block = ((struct block_meta *) ptr) - 1;
+	if (!best)
+		return NULL;
 
-	// align the new size and old size;
-	// these have the size of the struct added to them as well
-	size_t new_size_aligned = ALIGN8(size + SIZEOF_STRUCT_BLOCK_META);
-	size_t old_size_aligned = ALIGN8(block->size + SIZEOF_STRUCT_BLOCK_META);
+	bin_remove(a, best);
+	best->status = STATUS_ALLOC;
 
-	// if the block we are trying to realloc is not being used, return NULL
-	if (block->status == STATUS_FREE)
+	// check if the block needs to be split; the second part has to be
+	// big enough to be reused
+	if (split_fits(a, best, size))
+		split_block(a, best, size);
+
+	// the next search starts after this block
+	if (policy == OS_FIT_NEXT)
+		a->next_fit = (char *) BLOCK_END(best);
+
+	return best;
+}
+
+
+/* map "len" bytes aligned to HUGE_PAGE_SIZE, which "len" has to be a
+ * multiple of, and ask for transparent huge pages for them
+ */
+void *huge_map(size_t len)
+{
+	char *chunk = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+					   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	// running out of memory is not fatal, the allocation just fails
+	if (chunk == MAP_FAILED)
 		return NULL;
 
-	// if the block we are trying to realloc is also the last one and
-	// the new size is smaller than MMAP_THRESHOLD, we can use sbrk to allocate
-	// it by expanding the last block, similar to what we did before
-	if (block == mem_end && old_size_aligned < new_size_aligned &&
-		ALIGN8(size) < MMAP_THRESHOLD - SIZEOF_STRUCT_BLOCK_META) {
-		struct block_meta *res = sbrk(ALIGN8(size - mem_end->size));
+	// give back what is around the aligned part
+	char *start = (char *) HUGE_ALIGN((uintptr_t) chunk);
+	char *end = chunk + len + HUGE_PAGE_SIZE;
 
-		// check the error code
-		DIE(res == (void *) -1, "sbrk failed");
+	if (start > chunk) {
+		int res = munmap(chunk, start - chunk);
 
-		mem_end->size = ALIGN8(size);
-		mem_end->status = STATUS_ALLOC;
-		return mem_end + 1;
+		DIE(res == -1, "munmap failed");
 	}
 
-	// coalesce blocks until we can fit the new size
-	if (old_size_aligned < new_size_aligned &&
-		new_size_aligned < MMAP_THRESHOLD) {
-		struct block_meta *temp = NULL;
+	if (end > start + len) {
+		int res = munmap(start + len, end - (start + len));
+
+		DIE(res == -1, "munmap failed");
+	}
 
-		// while the next block exists and is free try to merge the blocks
-		while (block->next && block->next->status == STATUS_FREE) {
-			temp = block->next;
+	// this fails if transparent huge pages are turned off, the memory can
+	// still be used
+	madvise(start, len, MADV_HUGEPAGE);
 
-			// if the size of the new block would become bigger than
-			// MMAP_THRESHOLD, quit the merging algorithm, as that
-			// new block would become too big to be stored in the list
-			if (ALIGN8(block->size + temp->size + SIZEOF_STRUCT_BLOCK_META) >
-				MMAP_THRESHOLD)
-				break;
+	return start;
+}
 
-			// go to the next block and update the base block
-			block->next = block->next->next;
-			block->size += temp->size + SIZEOF_STRUCT_BLOCK_META;
-			block->size = ALIGN8(block->size);
+/* map a fresh chunk for a mapped block of *len bytes, with huge pages if
+ * they are on and it is big enough; *len is updated to the length of the
+ * chunk, and *huge is set if it uses MAP_HUGETLB pages; returns NULL if
+ * there is no memory left
+ */
+void *chunk_map(size_t *len, unsigned char *huge)
+{
+	int mode = __atomic_load_n(&huge_pages, __ATOMIC_RELAXED);
 
-			// at last, if the block becomes big enough to fit the new size
-			// quit the merging algorithm;
-			if (ALIGN8(block->size + SIZEOF_STRUCT_BLOCK_META) >=
-				new_size_aligned)
-				break;
-		}
+	*huge = 0;
+
+	if (mode == OS_HUGE_OFF || *len < HUGE_PAGE_SIZE) {
+		void *chunk = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+						   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		return chunk == MAP_FAILED ? NULL : chunk;
 	}
 
-	// update the size of the base block
-	old_size_aligned = ALIGN8(block->size + SIZEOF_STRUCT_BLOCK_META);
+	*len = HUGE_ALIGN(*len);
 
-	// if the sizes are now equal, our job is done, return the original pointer
-	if (old_size_aligned == new_size_aligned)
-		return ptr;
+	// the huge page pool may be empty, or there may be none at all
+	if (mode == OS_HUGE_TLB) {
+		void *chunk = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+						   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
 
-	// if the block is big enough to be split, do it
-	if (old_size_aligned > new_size_aligned + SIZEOF_STRUCT_BLOCK_META) {
-		// if is has been allocated with mmap, alloc a new block
-		// and free the old one
-		if (block->status == STATUS_MAPPED) {
-			void *newptr = os_malloc(size);
+		if (chunk != MAP_FAILED) {
+			*huge = 1;
+			return chunk;
+		}
+	}
 
-			if (!newptr)
-				return NULL;
+	return huge_map(*len);
+}
+
+/* set the page map entries of a mapped block: the page of its payload start,
+ * which finds the block, and in hardened builds the first and last pages of
+ * its chunk too, which block_verify() checks its header against
+ */
+void mapped_pagemap(struct block_meta *block, uintptr_t entry)
+{
+	pagemap_set(block + 1, 1, entry);
+
+	if (HARDEN) {
+		char *chunk = (char *) block - block->offset;
 
-			// copy the contens from the old address
-			memcpy(newptr, ptr, new_size_aligned);
-			os_free(ptr);
+		pagemap_set(chunk, 1, entry);
+		pagemap_set((char *) (block + 1) + block->size - 1, 1, entry);
+	}
+}
 
-			return newptr;
+/* create a new memory block for the given arena */
+struct block_meta *create_block(struct arena *a, size_t size, size_t treshold)
+{
+	struct block_meta *new_block = NULL;
+	unsigned char new_block_huge = 0;
+
+	// if the given size is smaller than the treshold value, grow the region
+	// of the arena; otherwise, use mmap
+	if (ALIGN16(size) < treshold) {
+		int zero;
+
+		// the region is reserved the first time the arena needs memory,
+		// on the node of the arena
+		if (!a->region.base) {
+			region_init(&a->region, ARENA_REGION, 1);
+			region_bind(&a->region, a->node);
 		}
 
-		// if sbrk has been used, simply split the block
-		if (block->status == STATUS_ALLOC) {
-			split_block(block, size);
+		new_block = region_grow(&a->region,
+								ALIGN16(size + SIZEOF_STRUCT_BLOCK_META), &zero);
 
-			return ptr;
+		if (!new_block)
+			return NULL;
+
+		// it goes after the last block of the list, see heap_alloc()
+		*new_block = (struct block_meta) {
+			.status = STATUS_ALLOC,
+			.zero = zero,
+			.size = ALIGN16(size),
+		};
+		BLOCK_SEAL(new_block);
+
+		// the new pages belong to the arena
+		pagemap_set(new_block, ALIGN16(size + SIZEOF_STRUCT_BLOCK_META),
+					(uintptr_t) a | PAGEMAP_HEAP);
+	} else {
+		// allocate independent memory chunk, reusing a recently freed one
+		// if the cache has one that fits; the whole chunk can be used
+		size_t len = PAGE_ALIGN(ALIGN16(size) + SIZEOF_STRUCT_BLOCK_META);
+
+		int zero = 0;
+
+		new_block = mmap_cache_get(&len, a->node);
+
+		// only fresh chunks are known to be zeroed; they are bound to the
+		// node of the arena before they are touched
+		if (new_block) {
+			STAT_ADD(STAT_MMAP_CACHE_HIT, 1);
+		} else {
+			new_block = chunk_map(&len, &new_block_huge);
+
+			if (!new_block)
+				return NULL;
+
+			STAT_ADD(STAT_MMAP, 1);
+			numa_bind(new_block, len, a->node);
+			zero = 1;
 		}
+
+		*new_block = (struct block_meta) {
+			.offset = 0,
+			.status = STATUS_MAPPED,
+			.zero = zero,
+			.huge = new_block_huge,
+			.node = a->node,
+			.size = len - SIZEOF_STRUCT_BLOCK_META,
+		};
+		BLOCK_SEAL(new_block);
+
+		mapped_pagemap(new_block, (uintptr_t) new_block | PAGEMAP_MAPPED);
 	}
 
-	// if the block is not big enough to be split, just return the pointer
-	if (old_size_aligned > new_size_aligned)
-		return ptr;
+	return new_block;
+}
 
-	// if no previous cases have matched our case, simply alloc a new block
-	// of memory and copy over the content from the old address
-	void *newptr = os_malloc(size);
 
-	if (!newptr)
+/* alloc a number of bytes on the heap when first using it */
+struct block_meta *prealloc(struct arena *a, size_t size)
+{
+	// create a new block of MMAP_THRESHOLD size, or of the needed size if
+	// the treshold has been raised past it
+	size_t prealloc_size = MMAP_THRESHOLD - SIZEOF_STRUCT_BLOCK_META;
+
+	if (size > prealloc_size)
+		prealloc_size = size;
+
+	struct block_meta *new_block = create_block(a, prealloc_size,
+												prealloc_size + 1);
+
+	if (!new_block)
 		return NULL;
 
-	memcpy(newptr, ptr, old_size_aligned);
+	// initialize the list
+	a->mem_begin = new_block;
+	a->mem_end = a->mem_begin;
 
-	if (newptr != ptr)
-		os_free(ptr);
+	// keep what we do not need in the bins for the next allocations
+	if (split_fits(a, new_block, size))
+		split_block(a, new_block, size);
 
-	return newptr;
+	// return the payload
+	return (new_block + 1);
 }
 
-/* frees memory allocated by os_malloc(), os_calloc() or os_realloc() */
-void os_free(void *ptr)
+
+/* give the whole pages of a free block that lie between start and end back
+ * to the system, keeping its header, its stamp and its slot;
+ * returns 1 if there were any
+ */
+int block_purge(struct block_meta *block, char *start, char *end)
 {
-	/* TODO: Implement os_free */
-	if (!ptr)
-		return;
+	if (start < (char *) (&BLOCK_SLOT(block) + 1))
+		start = (char *) (&BLOCK_SLOT(block) + 1);
+
+	// the heap may be made of transparent huge pages, only whole ones are
+	// given back, so none of them is split
+	if (__atomic_load_n(&huge_pages, __ATOMIC_RELAXED)) {
+		start = (char *) HUGE_ALIGN((uintptr_t) start);
+		end = (char *) HUGE_TRUNC((uintptr_t) end);
+	} else {
+		start = (char *) PAGE_ALIGN((uintptr_t) start);
+		end = (char *) PAGE_TRUNC((uintptr_t) end);
+	}
 
-	// get the block_meta structure from the given pointer
-	struct block_meta *to_free_block = ((struct block_meta *) ptr) - 1;
+	if (start >= end)
+		return 0;
 
-	// if the block has been allocated with sbrk, just mark is as free
-	if (to_free_block->status == STATUS_ALLOC)
-		to_free_block->status = STATUS_FREE;
+	// the pages read back as zeroes the next time they are used
+	int res = madvise(start, end - start, MADV_DONTNEED);
 
-	// otherwise, change the flag and also call munmap
-	else if (to_free_block->status == STATUS_MAPPED) {
-		to_free_block->status = STATUS_FREE;
+	DIE(res == -1, "madvise failed");
+	STAT_ADD(STAT_PURGE, 1);
 
-		int res = munmap(to_free_block, to_free_block->size +
-							SIZEOF_STRUCT_BLOCK_META);
+	return 1;
+}
 
-		DIE(res == -1, "munmap fail");
-	}
+/* lower the end of the region while the last block of the heap is free,
+ * keeping "pad" bytes of it; "all" decommits every page past the new end,
+ * otherwise the region keeps some to grow back into (see region_shrink());
+ * the arena lock must be held; returns 1 if anything was released
+ */
+int heap_trim(struct arena *a, size_t pad, int all)
+{
+	struct block_meta *last = a->mem_end;
+
+	if (!last || last->status != STATUS_FREE)
+		return 0;
+
+	char *end = (char *) BLOCK_END(last);
+
+	if (pad < MIN_PAYLOAD)
+		pad = MIN_PAYLOAD;
+
+	// the region is cut at a page boundary past what is kept
+	size_t size = ALIGN16(PAGE_ALIGN((uintptr_t) (last + 1) + pad) -
+						(uintptr_t) (last + 1));
+	char *keep = (char *) (last + 1) + size;
+
+	if (keep >= end)
+		return 0;
+
+	// the block keeps the time it was freed at, so the purge thread still
+	// takes what is left of it once that is due
+	uint64_t stamp = BLOCK_STAMP(last);
+
+	bin_remove(a, last);
+	last->size = size;
+	bin_insert(a, last);
+
+	if (!last->zero)
+		BLOCK_STAMP(last) = stamp;
+
+	// the released pages are no longer ours
+	pagemap_set(keep, end - keep, 0);
+	region_shrink(&a->region, end - keep, all);
+
+	return 1;
+}
+
+/* give a block back to the list of an arena, merged with its neighbours;
+ * the arena lock must be held
+ */
+void heap_release(struct arena *a, struct block_meta *block)
+{
+	char *start = (char *) block;
+	char *end = (char *) BLOCK_END(block);
+	size_t trim = __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED);
+
+	// mark the block as free, merge it with its free neighbours and put
+	// the result in its bin; what the block held is not known
+	block->status = STATUS_FREE;
+	block->zero = 0;
+	block = coalesce_blocks(a, block);
+	bin_insert(a, block);
+
+	// the purge thread gives the pages back once they have been free for
+	// long enough, so freeing costs nothing more
+	if (__atomic_load_n(&decay_ms, __ATOMIC_RELAXED))
+		return;
+
+	// a big free tail of the heap shrinks the region, keeping top_pad
+	// bytes of it; otherwise, the pages of a big freed block are given
+	// back, the block stays where it is
+	if (block == a->mem_end && block->size >= trim) {
+		heap_trim(a, __atomic_load_n(&top_pad, __ATOMIC_RELAXED), 0);
+		return;
+	}
+
+	if ((size_t) (end - start) >= trim)
+		block_purge(block, start, end);
+}
+
+/* put a freed block in its fast bin, unless it is not a fast bin size or
+ * it is the last block of the heap, which the heap grows into and trims;
+ * returns 1 if it did; the arena lock must be held
+ */
+int fast_put(struct arena *a, struct block_meta *block)
+{
+	size_t size = block->size;
+	size_t max = __atomic_load_n(&fast_max, __ATOMIC_RELAXED);
+
+	if (size <= SLAB_MAX || size > max || block == a->mem_end)
+		return 0;
+
+	unsigned int i = FAST_INDEX(size);
+
+	block->status = STATUS_FAST;
+	block->zero = 0;
+	*(struct block_meta **) (block + 1) = PROTECT(block + 1, a->fast[i]);
+	a->fast[i] = block;
+	a->fast_map |= 1ULL << i;
+
+	return 1;
+}
+
+/* take the head of a non-empty fast bin out of it */
+struct block_meta *fast_pop(struct arena *a, unsigned int i)
+{
+	struct block_meta *block = a->fast[i];
+
+	// the head came from the payload of the block before it
+	if (HARDEN && (block->status != STATUS_FAST || !BLOCK_SEALED(block)))
+		corrupt("corrupted fast bin", block);
+
+	a->fast[i] = REVEAL(block + 1, *(struct block_meta **) (block + 1));
+	LINK_CHECK(a->fast[i], "corrupted fast bin");
+
+	if (!a->fast[i])
+		a->fast_map &= ~(1ULL << i);
+
+	return block;
+}
+
+/* take the last block freed with a payload of "size" bytes out of its fast
+ * bin; returns NULL if there is none; the arena lock must be held
+ */
+struct block_meta *fast_get(struct arena *a, size_t size)
+{
+	if (size <= SLAB_MAX || size > FAST_LIMIT)
+		return NULL;
+
+	unsigned int i = FAST_INDEX(size);
+
+	if (!a->fast[i])
+		return NULL;
+
+	struct block_meta *block = fast_pop(a, i);
+
+	STAT_ADD(STAT_FAST, 1);
+	block->status = STATUS_ALLOC;
+
+	return block;
+}
+
+/* merge up to n blocks of the fast bins with their neighbours, taking the
+ * bins in turn, so none of them waits for the others to be empty; the
+ * arena lock must be held
+ */
+void fast_merge(struct arena *a, size_t n)
+{
+	while (n-- && a->fast_map) {
+		uint64_t map = a->fast_map & (~0ULL << a->fast_next);
+		unsigned int i = __builtin_ctzll(map ? map : a->fast_map);
+		struct block_meta *block = fast_pop(a, i);
+
+		a->fast_next = (i + 1) % NFAST;
+		heap_release(a, block);
+	}
+}
+
+/* give a block back to an arena: to a fast bin if it has the size for one,
+ * merged with its neighbours otherwise; the arena lock must be held
+ */
+void heap_free(struct arena *a, struct block_meta *block)
+{
+	if (!fast_put(a, block))
+		heap_release(a, block);
+}
+
+/* allocate an aligned size from the list of an arena;
+ * the arena lock must be held
+ */
+void *heap_alloc(struct arena *a, size_t size_aligned, size_t treshold)
+{
+	// get a new block that will hold the memory
+	struct block_meta *new_block = NULL;
+
+	// check the existing memory list for a fitting value if the size it needs
+	// is small enough to be allocated on the heap
+	if (a->mem_begin && size_aligned < treshold) {
+		// a block freed with the same size is reused as it is; otherwise,
+		// a few more of the fast bins are merged, so the work is spread
+		// over the allocations
+		new_block = fast_get(a, size_aligned);
+
+		if (new_block)
+			return new_block + 1;
+
+		fast_merge(a, FAST_MERGE);
+		new_block = find_best_block(a, size_aligned);
+
+		// merge everything that is left before the heap grows
+		if (!new_block && a->fast_map) {
+			fast_merge(a, SIZE_MAX);
+			new_block = find_best_block(a, size_aligned);
+		}
+
+		if (new_block) {
+			// if we have found a block, mark it as allocated and return
+			// the payload, that is adding 1 to the block_meta struct
+			new_block->status = STATUS_ALLOC;
+			return (new_block + 1);
+		}
+	}
+
+	// if we have not found a fitting block in the list, we can check
+	// the last block to see if it is free and, if so, expand it and use it;
+	// it always ends where the region does
+	if (a->mem_end && a->mem_end->status == STATUS_FREE &&
+		a->mem_end->size < size_aligned &&
+		size_aligned < treshold - SIZEOF_STRUCT_BLOCK_META) {
+		// get more space by computing the needed extra size
+		int zero;
+		size_t extra = ALIGN16(size_aligned - a->mem_end->size);
+		struct block_meta *res = region_grow(&a->region, extra, &zero);
+
+		if (!res)
+			return NULL;
+
+		pagemap_set(res, extra, (uintptr_t) a | PAGEMAP_HEAP);
+
+		bin_remove(a, a->mem_end);
+		a->mem_end->size = ALIGN16(size_aligned);
+		a->mem_end->status = STATUS_ALLOC;
+		a->mem_end->zero &= zero;
+		return a->mem_end + 1;
+	}
+
+	// if the list has not been used yet, prealloc memory on heap
+	if (size_aligned < treshold - SIZEOF_STRUCT_BLOCK_META && !a->mem_begin)
+		return prealloc(a, size_aligned);
+
+	// if none of the above cases were a match, create the block, at last
+	new_block = create_block(a, size_aligned,
+							treshold - SIZEOF_STRUCT_BLOCK_META);
+	if (!new_block)
+		return NULL;
+
+	// we requested a new block so we update the list if it is not mapped
+	// on its own; it starts where the last block ends
+	if (new_block->status == STATUS_ALLOC) {
+		if (a->mem_end)
+			new_block->prev_size = a->mem_end->size;
+		else
+			a->mem_begin = new_block;
+
+		a->mem_end = new_block;
+	}
+
+	// return the payload
+	return (new_block + 1);
+}
+
+
+/* give every free page of an arena back to the system, keeping "pad"
+ * bytes at the top of its heap; the arena lock must be held;
+ * returns 1 if anything was released
+ */
+int arena_trim(struct arena *a, size_t pad)
+{
+	// the blocks of the fast bins can only be given back once merged
+	fast_merge(a, SIZE_MAX);
+
+	int released = heap_trim(a, pad, 1);
+
+	for (struct block_meta *block = a->mem_begin; block;
+		 block = block_next(a, block))
+		if (block->status == STATUS_FREE)
+			released |= block_purge(block, (char *) block,
+									(char *) BLOCK_END(block));
+
+	return released;
+}
+
+
+/* push a chain of freed payloads, linked through their first word, onto
+ * the remote-free list of the arena they belong to, without its lock
+ */
+void remote_push(struct arena *a, void *first, void *last)
+{
+	void *head = __atomic_load_n(&a->remote_free, __ATOMIC_RELAXED);
+
+	STAT_ADD(STAT_REMOTE_FREE, 1);
+
+	do
+		*(void **) last = PROTECT(last, head);
+	while (!__atomic_compare_exchange_n(&a->remote_free, &head, first, 1,
+							__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* free everything other threads have pushed onto the remote-free list of
+ * an arena; the arena lock must be held
+ */
+void remote_drain(struct arena *a)
+{
+	if (!__atomic_load_n(&a->remote_free, __ATOMIC_RELAXED))
+		return;
+
+	// take the whole list at once, so there is no ABA problem
+	void *ptr = __atomic_exchange_n(&a->remote_free, NULL, __ATOMIC_ACQUIRE);
+
+	while (ptr) {
+		void *next = REVEAL(ptr, *(void **) ptr);
+		struct slab *s = slab_of(ptr);
+
+		LINK_CHECK(next, "corrupted remote-free list");
+
+		if (s) {
+			slab_free(a, s, ptr);
+		} else {
+			struct block_meta *block = ((struct block_meta *) ptr) - 1;
+
+			// the block was pushed twice, before it was drained
+			if (HARDEN && block->status != STATUS_ALLOC)
+				corrupt("double free", ptr);
+
+			heap_free(a, block);
+		}
+
+		ptr = next;
+	}
+}
+
+/* give back the pages of the free blocks of an arena that have been dirty
+ * for "age" ms, and its free top; the free blocks of other threads are
+ * taken first; the arena lock must be held
+ */
+void arena_decay(struct arena *a, uint64_t now, uint64_t age)
+{
+	size_t page = getpagesize();
+
+	remote_drain(a);
+
+	struct block_meta *last = a->mem_end;
+
+	// only blocks with a whole page have anything to give back; only the
+	// sizes in the bins are read for the others
+	for (size_t idx = bin_next(a, bin_index(page)); idx < NBINS;
+		 idx = bin_next(a, idx + 1)) {
+		struct bin *b = &a->bins[idx];
+
+		for (unsigned int i = 0; i < b->count; i++) {
+			struct block_meta *block = b->entries[i].block;
+
+			if (b->entries[i].size < page)
+				continue;
+
+			uint64_t stamp = block->zero ? 0 : BLOCK_STAMP(block);
+
+			if (!stamp || now - stamp < age || block == last)
+				continue;
+
+			block_purge(block, (char *) block, (char *) BLOCK_END(block));
+			BLOCK_STAMP(block) = 0;
+		}
+	}
+
+	// the top of the heap goes back to the region, whatever its size
+	if (last && last->status == STATUS_FREE && !last->zero &&
+		BLOCK_STAMP(last) && now - BLOCK_STAMP(last) >= age)
+		heap_trim(a, 0, 1);
+}
+
+
+/* push an object onto a bin of a thread cache */
+void tcache_push(struct tcache *tc, unsigned int class, void *ptr)
+{
+	*(void **) ptr = PROTECT(ptr, tc->entries[class]);
+
+	if (HARDEN)
+		((uintptr_t *) ptr)[1] = tcache_secret;
+
+	tc->entries[class] = ptr;
+	tc->count[class]++;
+}
+
+/* take the head of a non-empty bin of a thread cache */
+void *tcache_pop(struct tcache *tc, unsigned int class)
+{
+	void *ptr = tc->entries[class];
+
+	tc->entries[class] = REVEAL(ptr, *(void **) ptr);
+	tc->count[class]--;
+	LINK_CHECK(tc->entries[class], "corrupted thread cache");
+
+	if (HARDEN)
+		((uintptr_t *) ptr)[1] = 0;
+
+	return ptr;
+}
+
+/* abort if an object that is being freed, and holds tcache_secret, is in
+ * the thread cache already
+ */
+void tcache_check(struct tcache *tc, unsigned int class, void *ptr)
+{
+	for (void *e = tc->entries[class]; e; e = REVEAL(e, *(void **) e))
+		if (e == ptr)
+			corrupt("double free", ptr);
+}
+
+/* give the objects of a thread cache bin back to their slabs,
+ * until only "keep" objects are left
+ */
+void tcache_flush(struct tcache *tc, unsigned int class, unsigned int keep)
+{
+	struct arena *own = thread_arena;
+	struct arena *chain_arena = NULL;
+	void *chain_first = NULL;
+	void *chain_last = NULL;
+	int locked = 0;
+
+	if (tc->count[class] > keep)
+		STAT_ADD(STAT_TCACHE_FLUSH, 1);
+
+	while (tc->count[class] > keep) {
+		void *ptr = tcache_pop(tc, class);
+		struct slab *s = slab_of(ptr);
+		struct arena *a = &arenas[s->arena];
+
+		if (a == own) {
+			if (!locked) {
+				pthread_mutex_lock(&own->lock);
+				locked = 1;
+			}
+
+			slab_free(a, s, ptr);
+			continue;
+		}
+
+		// objects freed by other threads may belong to other arenas; they
+		// are chained while consecutive objects belong to the same arena,
+		// and each chain is pushed onto its remote-free list at once
+		if (a != chain_arena) {
+			if (chain_arena)
+				remote_push(chain_arena, chain_first, chain_last);
+
+			chain_arena = a;
+			chain_last = ptr;
+		} else {
+			*(void **) ptr = PROTECT(ptr, chain_first);
+		}
+
+		chain_first = ptr;
+	}
+
+	if (chain_arena)
+		remote_push(chain_arena, chain_first, chain_last);
+
+	if (locked)
+		pthread_mutex_unlock(&own->lock);
+}
+
+/* give every cached object back to its slab when a thread exits */
+void tcache_destroy(void *arg)
+{
+	struct tcache *tc = arg;
+
+	for (unsigned int i = 0; i < SLAB_CLASSES; i++)
+		tcache_flush(tc, i, 0);
+
+	// later destructors go straight to the slabs
+	tc->disabled = 1;
+}
+
+void tcache_key_create(void)
+{
+	pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/* make sure the thread cache is flushed when the thread exits */
+void tcache_register(struct tcache *tc)
+{
+	pthread_once(&tcache_once, tcache_key_create);
+	pthread_setspecific(tcache_key, tc);
+	tc->registered = 1;
+}
+
+/* take an object of the given size class out of the thread cache,
+ * filling the cache from the slabs if it is empty
+ */
+void *tcache_get(unsigned int class)
+{
+	struct tcache *tc = &tcache;
+	struct arena *a = arena_get();
+
+	if (tc->disabled) {
+		pthread_mutex_lock(&a->lock);
+		remote_drain(a);
+		void *out = slab_alloc(a, class);
+
+		pthread_mutex_unlock(&a->lock);
+
+		return out;
+	}
+
+	if (!tc->registered)
+		tcache_register(tc);
+
+	// refill half of the cache under a single lock, taking the objects
+	// other threads have freed first
+	if (!tc->entries[class]) {
+		STAT_ADD(STAT_TCACHE_REFILL, 1);
+		pthread_mutex_lock(&a->lock);
+		remote_drain(a);
+
+		while (tc->count[class] < TCACHE_COUNT / 2) {
+			void *out = slab_alloc(a, class);
+
+			if (!out)
+				break;
+
+			tcache_push(tc, class, out);
+		}
+
+		pthread_mutex_unlock(&a->lock);
+
+		if (!tc->entries[class])
+			return NULL;
+	}
+
+	return tcache_pop(tc, class);
+}
+
+/* put a slab object in the thread cache, flushing half of its bin to
+ * the slabs if it is full
+ */
+void tcache_put(struct slab *s, void *ptr)
+{
+	struct tcache *tc = &tcache;
+
+	if (tc->disabled) {
+		struct arena *a = &arenas[s->arena];
+
+		if (a != thread_arena) {
+			remote_push(a, ptr, ptr);
+			return;
+		}
+
+		pthread_mutex_lock(&a->lock);
+		slab_free(a, s, ptr);
+		pthread_mutex_unlock(&a->lock);
+
+		return;
+	}
+
+	if (!tc->registered)
+		tcache_register(tc);
+
+	// only the objects that hold tcache_secret, which are in the cache
+	// unless the user wrote it there, have to be looked for, so the others
+	// cost a compare and no call
+	if (HARDEN && ((uintptr_t *) ptr)[1] == tcache_secret)
+		tcache_check(tc, s->class, ptr);
+
+	if (tc->count[s->class] == TCACHE_COUNT)
+		tcache_flush(tc, s->class, TCACHE_COUNT / 2);
+
+	tcache_push(tc, s->class, ptr);
+}
+
+
+/* get the mmap treshold of os_calloc() */
+size_t calloc_threshold_get(void)
+{
+	size_t treshold = __atomic_load_n(&calloc_threshold, __ATOMIC_RELAXED);
+
+	return treshold ? treshold : (size_t) getpagesize();
+}
+
+/* raise a treshold to "len", unless it is already past it */
+void threshold_raise(size_t *treshold, size_t len)
+{
+	size_t old = __atomic_load_n(treshold, __ATOMIC_RELAXED);
+
+	while (old < len && !__atomic_compare_exchange_n(treshold, &old, len, 0,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* a mapped chunk of "len" bytes has been freed; raise the treshold it was
+ * mapped under to its length, so the next blocks of its size are served
+ * from the heap, like glibc does with M_MMAP_THRESHOLD
+ */
+void threshold_update(size_t len)
+{
+	if (len > MMAP_THRESHOLD_MAX)
+		return;
+
+	// chunks under the malloc treshold can only come from os_calloc()
+	if (len >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+		if (!__atomic_load_n(&mmap_threshold_fixed, __ATOMIC_RELAXED))
+			threshold_raise(&mmap_threshold, len);
+
+		// blocks of this size now come and go on the heap, do not give
+		// their memory back every time
+		if (!__atomic_load_n(&trim_threshold_fixed, __ATOMIC_RELAXED))
+			threshold_raise(&trim_threshold, 2 * len);
+	} else if (len >= calloc_threshold_get()) {
+		if (!__atomic_load_n(&calloc_threshold_fixed, __ATOMIC_RELAXED))
+			threshold_raise(&calloc_threshold, len);
+	}
+}
+
+
+/* allocate a block of an aligned size from the given arena: from its heap
+ * if it is under the treshold, or mapped on its own, which does not need
+ * the lock; if zero is not NULL, it is set if the payload is known to hold
+ * only zeroes
+ */
+struct block_meta *arena_alloc(struct arena *a, size_t size_aligned,
+							   size_t treshold, int *zero)
+{
+	struct block_meta *block;
+
+	if (size_aligned >= treshold) {
+		block = create_block(a, size_aligned,
+							 treshold - SIZEOF_STRUCT_BLOCK_META);
+
+		if (block && zero)
+			*zero = block->zero;
+
+		if (block)
+			block->zero = 0;
+
+		return block;
+	}
+
+	pthread_mutex_lock(&a->lock);
+	remote_drain(a);
+
+	block = heap_alloc(a, size_aligned, treshold);
+
+	// the user is about to write in the block; the flag shares a word
+	// with the status, which has to be written under the lock, as the
+	// neighbours of the block read it
+	if (block) {
+		block--;
+
+		if (zero)
+			*zero = block->zero;
+
+		block->zero = 0;
+	}
+
+	pthread_mutex_unlock(&a->lock);
+
+	return block;
+}
+
+/* auxiliary malloc function that takes
+ * a treshold value as an extra parameter; if zero is not NULL, it is set
+ * if the payload is known to hold only zeroes
+ */
+void *os_malloc_aux(size_t size, size_t treshold, int *zero)
+{
+	// early exit case
+	if (size <= 0)
+		return NULL;
+
+	// sizes this big cannot even be aligned
+	if (size > SIZE_MAX / 2) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (zero)
+		*zero = 0;
+
+	STAT_ADD(STAT_CLASSES + size_class(size), 1);
+
+	// small objects come from the slabs, through the thread cache, so
+	// most of them need neither a header nor any locking
+	if (size <= SLAB_MAX) {
+		void *out = tcache_get(SLAB_CLASS(size));
+
+		if (out) {
+			STAT_ALLOC(STAT_SLAB, SLAB_CLASS_SIZE(SLAB_CLASS(size)));
+			PROF_ALLOC(out, size);
+			return out;
+		}
+	}
+
+	// align the size; every block has a payload of at least MIN_PAYLOAD
+	size_t size_aligned = ALIGN16(size);
+
+	if (size_aligned < MIN_PAYLOAD)
+		size_aligned = MIN_PAYLOAD;
+
+	struct block_meta *block = arena_alloc(arena_get(), size_aligned,
+										   treshold, zero);
+
+	if (!block)
+		return NULL;
+
+	STAT_ALLOC(block->status == STATUS_MAPPED ? STAT_MAPPED : STAT_HEAP,
+			   block->size);
+	PROF_ALLOC(block + 1, size);
+
+	return block + 1;
+}
+
+
+/* calls os_malloc_aux with the malloc mmap treshold */
+void *os_malloc(size_t size)
+{
+	void *out = os_malloc_aux(size, __atomic_load_n(&mmap_threshold,
+													__ATOMIC_RELAXED), NULL);
+
+	TRACE(TRACE_MALLOC, out, NULL, size);
+
+	return out;
+}
+
+
+/* allocate memory whose pages come from the given NUMA node, from the
+ * first arena of that node; meant for big buffers, so the thread cache is
+ * not used
+ */
+void *os_malloc_onnode(size_t size, int node)
+{
+	pthread_once(&arenas_once, arenas_init);
+
+	if (node < 0 || (unsigned int) node >= numa_nodes) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!size)
+		return NULL;
+
+	if (size > SIZE_MAX / 2) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	size_t size_aligned = ALIGN16(size);
+
+	if (size_aligned < MIN_PAYLOAD)
+		size_aligned = MIN_PAYLOAD;
+
+	// arena i is on node i % numa_nodes
+	struct block_meta *block = arena_alloc(&arenas[node], size_aligned,
+					__atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED), NULL);
+
+	if (!block)
+		return NULL;
+
+	STAT_ADD(STAT_CLASSES + size_class(size), 1);
+	STAT_ALLOC(block->status == STATUS_MAPPED ? STAT_MAPPED : STAT_HEAP,
+			   block->size);
+	PROF_ALLOC(block + 1, size);
+	TRACE(TRACE_MALLOC, block + 1, NULL, size);
+
+	return block + 1;
+}
+
+
+/* calls os_malloc_aux with the calloc mmap treshold
+ * and sets every byte to 0
+ */
+void *os_calloc(size_t nmemb, size_t size)
+{
+	size_t total;
+	int zero;
+
+	// a product that overflows would give a block too small for it
+	if (__builtin_mul_overflow(nmemb, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	void *out = os_malloc_aux(total, calloc_threshold_get(), &zero);
+
+	TRACE(TRACE_CALLOC, out, NULL, total);
+
+	if (!out)
+		return NULL;
+
+	// set bytes to 0; fresh memory already is
+	if (!zero)
+		memset((void *) out, 0, total);
+
+	return out;
+}
+
+/* abort if a pointer given to os_free() or os_realloc() is not the
+ * payload of a block in use: its header has to hold its canary, a mapped
+ * one has to be where the page map says, with its whole chunk, and it must
+ * not be free; a mapped block that was freed left a page map entry of no
+ * kind behind
+ */
+void block_verify(struct block_meta *block, uintptr_t entry)
+{
+	if (!PAGEMAP_KIND(entry)) {
+		if (PAGEMAP_PTR(entry) == block)
+			corrupt("double free", block + 1);
+
+		return;
+	}
+
+	if ((PAGEMAP_KIND(entry) == PAGEMAP_MAPPED &&
+		 PAGEMAP_PTR(entry) != block) || !BLOCK_SEALED(block))
+		corrupt("invalid pointer", block + 1);
+
+	// the size and offset of the header are not sealed, so the chunk they
+	// give has to start and end on pages of this block, or munmap() and
+	// mremap() would get someone else's pages
+	if (PAGEMAP_KIND(entry) == PAGEMAP_MAPPED) {
+		char *chunk = (char *) block - block->offset;
+		char *last = (char *) (block + 1) + block->size - 1;
+
+		if (PAGE_TRUNC((uintptr_t) chunk) != (uintptr_t) chunk ||
+			pagemap_get(chunk) != entry || pagemap_get(last) != entry)
+			corrupt("corrupted header", block + 1);
+	}
+
+	if (block->status == STATUS_FREE || block->status == STATUS_FAST)
+		corrupt("double free", block + 1);
+}
+
+/* resize a mapped block with mremap(), which moves its pages instead of
+ * copying them; returns the new payload
+ */
+void *mapped_realloc(struct block_meta *block, size_t size)
+{
+	size_t offset = block->offset;
+	size_t old_len = offset + block->size + SIZEOF_STRUCT_BLOCK_META;
+	size_t len = PAGE_ALIGN(offset + ALIGN16(size) + SIZEOF_STRUCT_BLOCK_META);
+
+	// MAP_HUGETLB chunks are not remapped, they only change if they no
+	// longer fit or at least a huge page can be given back
+	if (block->huge && ALIGN16(size) <= block->size &&
+		block->size - ALIGN16(size) < HUGE_PAGE_SIZE)
+		return block + 1;
+
+	// a block that is small enough for the heap is moved there, the copy
+	// is cheap; aligned blocks may be mapped while being that small; the
+	// treshold it is held against is never over MMAP_THRESHOLD, as the
+	// adaptive one rises past mapped blocks, which would be copied on
+	// every growth instead of being remapped
+	size_t treshold = __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+
+	if (treshold > MMAP_THRESHOLD)
+		treshold = MMAP_THRESHOLD;
+
+	if (block->huge || ALIGN16(size) < treshold) {
+		void *newptr = os_malloc(size);
+
+		if (!newptr)
+			return NULL;
+
+		memcpy(newptr, block + 1, size < block->size ? size : block->size);
+		os_free(block + 1);
+
+		return newptr;
+	}
+
+	// a growing block gets half of its length on top, so a buffer that
+	// keeps growing is only remapped a logarithmic number of times; the
+	// pages it does not use yet cost nothing
+	if (len > old_len && len < old_len + old_len / 2)
+		len = PAGE_ALIGN(old_len + old_len / 2);
+
+	// a chunk as big as a huge page is made of whole huge pages, like
+	// chunk_map() maps them
+	int thp = __atomic_load_n(&huge_pages, __ATOMIC_RELAXED) != OS_HUGE_OFF &&
+			  len >= HUGE_PAGE_SIZE;
+
+	if (thp)
+		len = HUGE_ALIGN(len);
+
+	if (len == old_len)
+		return block + 1;
+
+	// the chunk keeps its offset in the page, but realloc() does not have
+	// to keep a bigger alignment; a chunk of huge pages only grows where
+	// it is if it starts on a huge page, else it moves to a range aligned
+	// to one, as the kernel cannot back one that is not with huge pages
+	char *old = (char *) block - offset;
+	int aligned = !((uintptr_t) old & (HUGE_PAGE_SIZE - 1));
+
+	// the page map entries of the chunk change with its ends
+	mapped_pagemap(block, 0);
+
+	char *chunk = MAP_FAILED;
+
+	if (!thp)
+		chunk = mremap(old, old_len, len, MREMAP_MAYMOVE);
+	else if (aligned)
+		chunk = mremap(old, old_len, len, 0);
+
+	if (chunk == MAP_FAILED && thp) {
+		char *target = huge_map(len);
+
+		if (target) {
+			chunk = mremap(old, old_len, len, MREMAP_MAYMOVE | MREMAP_FIXED,
+						   target);
+
+			if (chunk == MAP_FAILED) {
+				int res = munmap(target, len);
+
+				DIE(res == -1, "munmap failed");
+			}
+		}
+	}
+
+	// the block stays as it was if it cannot grow
+	if (chunk == MAP_FAILED) {
+		mapped_pagemap(block, (uintptr_t) block | PAGEMAP_MAPPED);
+		return NULL;
+	}
+
+	// the moved pages keep the advice of the old chunk, which may have
+	// been too small for huge pages
+	if (thp)
+		madvise(chunk, len, MADV_HUGEPAGE);
+
+	struct block_meta *new_block = (struct block_meta *) (chunk + offset);
+
+	STAT_ADD(STAT_MREMAP, 1);
+	STAT_RESIZE(STAT_MAPPED, new_block->size,
+				len - offset - SIZEOF_STRUCT_BLOCK_META);
+	new_block->size = len - offset - SIZEOF_STRUCT_BLOCK_META;
+
+	if (new_block != block)
+		BLOCK_SEAL(new_block);
+
+	mapped_pagemap(new_block, (uintptr_t) new_block | PAGEMAP_MAPPED);
+
+	return new_block + 1;
+}
+
+/* resize an allocated heap block in place, for os_realloc(): a block that
+ * shrinks gives its end back, one that grows takes the free block after
+ * it, grows the region if it is the last one, or takes the free block
+ * before it, its payload being moved down; the arena lock must be held;
+ * returns the new payload, or NULL if the block has to be moved
+ */
+void *heap_resize(struct arena *a, struct block_meta *block, size_t size)
+{
+	size_t need = ALIGN16(size);
+	size_t old_size = block->size;
+	size_t treshold = __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+	struct block_meta *next = block_next(a, block);
+	struct block_meta *prev = block_prev(a, block);
+
+	// an overflow out of the block, or into it, has hit a neighbour
+	if (HARDEN && next && !BLOCK_SEALED(next))
+		corrupt("corrupted header after", block + 1);
+
+	if (HARDEN && prev && !BLOCK_SEALED(prev))
+		corrupt("corrupted header before", block + 1);
+
+	if (need <= block->size) {
+		if (split_fits(a, block, size))
+			split_block(a, block, size);
+
+		return block + 1;
+	}
+
+	// a block that would get to the treshold is mapped instead, like a new
+	// one would be
+	if (need + SIZEOF_STRUCT_BLOCK_META >= treshold)
+		return NULL;
+
+	size_t room = next && next->status == STATUS_FREE ?
+				  next->size + SIZEOF_STRUCT_BLOCK_META : 0;
+
+	// the free block after it is taken if it is enough, or if it is the
+	// top of the heap, which the region grows from
+	if (room && (block->size + room >= need || next == a->mem_end)) {
+		STAT_ADD(STAT_COALESCE, 1);
+		bin_remove(a, next);
+		block->size += room;
+
+		if (a->mem_end == next)
+			a->mem_end = block;
+	}
+
+	if (block == a->mem_end && block->size < need) {
+		int zero;
+		size_t extra = need - block->size;
+		struct block_meta *res = region_grow(&a->region, extra, &zero);
+
+		if (res) {
+			pagemap_set(res, extra, (uintptr_t) a | PAGEMAP_HEAP);
+			block->size = need;
+		}
+	}
+
+	// otherwise, the payload moves down to the free block before it, which
+	// takes over the block; only one that can hold the new size by itself
+	// is taken, as creeping down into smaller ones just moves the block
+	// again with the next realloc, and steals the room the block before
+	// grows into
+	if (block->size < need && prev && prev->status == STATUS_FREE &&
+		prev->size >= need) {
+		STAT_ADD(STAT_COALESCE, 1);
+		bin_remove(a, prev);
+
+		prev->size += SIZEOF_STRUCT_BLOCK_META + block->size;
+		prev->status = STATUS_ALLOC;
+		prev->zero = 0;
+
+		if (a->mem_end == block)
+			a->mem_end = prev;
+
+		memmove(prev + 1, block + 1, old_size);
+		block = prev;
+	}
+
+	block_link(a, block);
+
+	if (block->size < need)
+		return NULL;
+
+	// give back what is left over, if it makes a block
+	if (split_fits(a, block, size))
+		split_block(a, block, size);
+
+	return block + 1;
+}
+
+/* change the size of the memory block to "size" bytes, leaving the samples
+ * of the profiler to os_realloc()
+ */
+void *os_realloc_aux(void *ptr, size_t size)
+{
+	STAT_ADD(STAT_REALLOC, 1);
+
+	// early exit cases
+	if (ptr == NULL)
+		return os_malloc(size);
+
+	if (size == 0) {
+		os_free(ptr);
+		return NULL;
+	}
+
+	// sizes this big cannot even be aligned
+	if (size > SIZE_MAX / 2) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// find out what the pointer is from the page map; a slab object can
+	// only grow up to the size of its class
+	uintptr_t entry = pagemap_get(ptr);
+
+	if (PAGEMAP_KIND(entry) == PAGEMAP_SLAB) {
+		struct slab *s = PAGEMAP_PTR(entry);
+
+		if (size <= s->size)
+			return ptr;
+
+		void *newptr = os_malloc(size);
+
+		if (!newptr)
+			return NULL;
+
+		memcpy(newptr, ptr, s->size);
+		os_free(ptr);
+
+		return newptr;
+	}
+
+	// every block has a payload of at least MIN_PAYLOAD
+	if (size < MIN_PAYLOAD)
+		size = MIN_PAYLOAD;
+
+	// get the block_meta structure from the given pointer;
+	// to do that, we need to cast the pointer and after that
+	// substract 1, as ptr is only the payload and we have to
+	// extract the metadata as well;
+	struct block_meta *block = ((struct block_meta *) ptr) - 1;
+
+	BLOCK_VERIFY(block, entry);
+
+	// pointers that are not ours are left alone
+	if (!PAGEMAP_KIND(entry) || (PAGEMAP_KIND(entry) == PAGEMAP_MAPPED &&
+				   PAGEMAP_PTR(entry) != block))
+		return NULL;
+
+	// if the block we are trying to realloc is not being used, return NULL
+	if (block->status == STATUS_FREE || block->status == STATUS_FAST)
+		return NULL;
+
+	// mapped blocks are resized by the kernel, without any lock
+	if (block->status == STATUS_MAPPED)
+		return mapped_realloc(block, size);
+
+	// a size that rounds up to the one of the block, or that is too close
+	// to it for a split, leaves the block as it is, without the lock
+	size_t old_size = block->size;
+
+	if (ALIGN16(size) <= old_size &&
+		old_size - ALIGN16(size) < SIZEOF_STRUCT_BLOCK_META + MIN_PAYLOAD)
+		return ptr;
+
+	// the in-place cases change the list of the block's own arena, so they
+	// run under its lock; it is released before falling back to
+	// os_malloc() and os_free()
+	struct arena *a = PAGEMAP_PTR(entry);
+
+	pthread_mutex_lock(&a->lock);
+
+	void *newptr = heap_resize(a, block, size);
+	struct block_meta *resized = newptr ? (struct block_meta *) newptr - 1 :
+							   block;
+
+	pthread_mutex_unlock(&a->lock);
+
+	// the block may have grown even if it did not fit, os_free() counts
+	// what it ends up with
+	STAT_RESIZE(STAT_HEAP, old_size, resized->size);
+
+	if (newptr)
+		return newptr;
+
+	// if no previous cases have matched our case, simply alloc a new block
+	// of memory and copy over the payload from the old address
+	newptr = os_malloc(size);
+
+	if (!newptr)
+		return NULL;
+
+	memcpy(newptr, ptr, old_size);
+	os_free(ptr);
+
+	return newptr;
+}
+
+/* change the size of the memory block to "size" bytes */
+void *os_realloc(void *ptr, size_t size)
+{
+	struct prof_sample *sample = NULL;
+
+	// a sampled block is tracked to wherever it ends up, or stays where it
+	// is if it cannot be resized
+	if (ptr && size && PROF_TRACKED(ptr))
+		sample = prof_take(ptr);
+
+	// the calls os_realloc_aux() makes are part of this one
+	trace_depth++;
+	void *out = os_realloc_aux(ptr, size);
+
+	trace_depth--;
+	TRACE(TRACE_REALLOC, out, ptr, size);
+
+	if (sample)
+		prof_move(sample, out ? out : ptr, out ? size : sample->size);
+
+	return out;
+}
+
+/* give the chunk of a mapped block back, to the mapped chunk cache or with
+ * munmap(); it takes no lock of an arena
+ */
+void mapped_free(struct block_meta *block)
+{
+	char *chunk = (char *) block - block->offset;
+	size_t len = block->offset + block->size + SIZEOF_STRUCT_BLOCK_META;
+
+	block->status = STATUS_FREE;
+	mapped_pagemap(block, 0);
+
+	// the page of the payload keeps the block, with no kind, so that
+	// freeing it again is told from a pointer that is not ours
+	if (HARDEN)
+		pagemap_set(block + 1, 1, (uintptr_t) block);
+
+	// MAP_HUGETLB pages go back to their pool right away
+	if (!block->huge && mmap_cache_put(chunk, len, block->node))
+		return;
+
+	int res = munmap(chunk, len);
+
+	DIE(res == -1, "munmap fail");
+	STAT_ADD(STAT_MUNMAP, 1);
+}
+
+/* frees memory allocated by os_malloc(), os_calloc() or os_realloc() */
+void os_free(void *ptr)
+{
+	if (!ptr)
+		return;
+
+	TRACE(TRACE_FREE, ptr, NULL, 0);
+	PROF_FREE(ptr);
+
+	// the page map tells what the pointer is, without trusting the bytes
+	// in front of it; pointers it does not know about are not ours and
+	// are left alone
+	uintptr_t entry = pagemap_get(ptr);
+
+	// get the block_meta structure from the given pointer
+	struct block_meta *to_free_block = ((struct block_meta *) ptr) - 1;
+
+	BLOCK_VERIFY(to_free_block, entry);
+
+	// slab objects have no header, the page map points to their slab;
+	// they go to the thread cache
+	if (PAGEMAP_KIND(entry) == PAGEMAP_SLAB) {
+		struct slab *s = PAGEMAP_PTR(entry);
+
+		STAT_FREE(STAT_SLAB, s->size);
+		tcache_put(s, ptr);
+	}
+
+	// if the block has been allocated on the heap, give it back to the list
+	// of the arena the page belongs to; if that is not our arena, the
+	// block goes onto its remote-free list instead of waiting for its lock
+	else if (PAGEMAP_KIND(entry) == PAGEMAP_HEAP &&
+			 to_free_block->status == STATUS_ALLOC) {
+		struct arena *a = PAGEMAP_PTR(entry);
+
+		STAT_FREE(STAT_HEAP, to_free_block->size);
+
+		if (a != thread_arena) {
+			remote_push(a, ptr, ptr);
+			return;
+		}
+
+		pthread_mutex_lock(&a->lock);
+		heap_free(a, to_free_block);
+		pthread_mutex_unlock(&a->lock);
+	}
+
+	// otherwise, change the flag and keep the chunk in the cache, or call
+	// munmap if it does not fit there; blocks of its size come from the
+	// heap from now on
+	else if (PAGEMAP_KIND(entry) == PAGEMAP_MAPPED &&
+			 PAGEMAP_PTR(entry) == to_free_block) {
+		STAT_FREE(STAT_MAPPED, to_free_block->size);
+		threshold_update(to_free_block->offset + to_free_block->size +
+						 SIZEOF_STRUCT_BLOCK_META);
+		mapped_free(to_free_block);
+	}
+}
+
+/* free a block whose size the caller knows; slab objects are found from
+ * their address alone, without looking the pointer up in the page map
+ */
+void os_free_sized(void *ptr, size_t size)
+{
+	if (size <= SLAB_MAX) {
+		struct slab *s = slab_of(ptr);
+
+		if (s) {
+			TRACE(TRACE_FREE, ptr, NULL, 0);
+			STAT_FREE(STAT_SLAB, s->size);
+			PROF_FREE(ptr);
+			tcache_put(s, ptr);
+			return;
+		}
+	}
+
+	// blocks with a header, or small blocks that are not slab objects, like
+	// aligned ones or heap blocks shrunk by os_realloc()
+	os_free(ptr);
+}
+
+/* get the number of bytes that can be used at ptr, which may be more than
+ * what was asked for; 0 for NULL or pointers that are not ours
+ */
+size_t os_malloc_usable_size(void *ptr)
+{
+	if (!ptr)
+		return 0;
+
+	uintptr_t entry = pagemap_get(ptr);
+	struct block_meta *block = ((struct block_meta *) ptr) - 1;
+
+	if (PAGEMAP_KIND(entry) == PAGEMAP_SLAB)
+		return ((struct slab *) PAGEMAP_PTR(entry))->size;
+
+	if (PAGEMAP_KIND(entry) == PAGEMAP_HEAP && block->status == STATUS_ALLOC)
+		return block->size;
+
+	if (PAGEMAP_KIND(entry) == PAGEMAP_MAPPED && PAGEMAP_PTR(entry) == block)
+		return block->size;
+
+	return 0;
+}
+
+/* split an allocated block into "count" blocks of size_aligned, putting
+ * their payloads in ptrs; the last one keeps what is left over;
+ * the arena lock must be held
+ */
+void heap_carve(struct arena *a, struct block_meta *block,
+				size_t size_aligned, size_t count, void **ptrs)
+{
+	block->zero = 0;
+
+	for (size_t i = 0; i < count - 1; i++) {
+		struct block_meta *next = (struct block_meta *)
+								  ((char *) (block + 1) + size_aligned);
+
+		*next = (struct block_meta) {
+			.prev_size = size_aligned,
+			.status = STATUS_ALLOC,
+			.size = block->size - size_aligned - SIZEOF_STRUCT_BLOCK_META,
+		};
+		BLOCK_SEAL(next);
+
+		if (a->mem_end == block)
+			a->mem_end = next;
+
+		block->size = size_aligned;
+		ptrs[i] = block + 1;
+		block = next;
+	}
+
+	block_link(a, block);
+	ptrs[count - 1] = block + 1;
+}
+
+/* allocate n blocks of "size" bytes at once into ptrs; returns how many
+ * were allocated, which is n unless size is 0 or the memory ran out
+ */
+size_t os_malloc_batch(size_t size, size_t n, void **ptrs)
+{
+	size_t i = 0;
+
+	if (!size || !n || size > SIZE_MAX / 2)
+		return 0;
+
+	// slab objects come from the thread cache first, then from the slabs,
+	// all under a single lock
+	if (size <= SLAB_MAX) {
+		struct tcache *tc = &tcache;
+		unsigned int class = SLAB_CLASS(size);
+
+		while (i < n && !tc->disabled && tc->entries[class])
+			ptrs[i++] = tcache_pop(tc, class);
+
+		struct arena *a = arena_get();
+
+		if (i < n) {
+			pthread_mutex_lock(&a->lock);
+			remote_drain(a);
+
+			while (i < n && (ptrs[i] = slab_alloc(a, class)))
+				i++;
+
+			pthread_mutex_unlock(&a->lock);
+		}
+
+		STAT_ADD(STAT_SLAB + STAT_ALLOCS, i);
+		STAT_ADD(STAT_SLAB + STAT_ALLOC_BYTES, i * SLAB_CLASS_SIZE(class));
+
+		if (i == n) {
+			STAT_ADD(STAT_CLASSES + size_class(size), n);
+
+			for (i = 0; i < n; i++) {
+				PROF_ALLOC(ptrs[i], size);
+				TRACE(TRACE_MALLOC, ptrs[i], NULL, size);
+			}
+
+			return n;
+		}
+	}
+
+	size_t size_aligned = ALIGN16(size);
+
+	if (size_aligned < MIN_PAYLOAD)
+		size_aligned = MIN_PAYLOAD;
+
+	// what is left is carved out of as few blocks of the list as possible,
+	// under a single lock; mapped blocks are mapped one by one
+	size_t treshold = __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+	size_t per_block = (treshold - 1) /
+					   (size_aligned + SIZEOF_STRUCT_BLOCK_META);
+
+	if (!per_block) {
+		for (size_t j = 0; j < i; j++)
+			TRACE(TRACE_MALLOC, ptrs[j], NULL, size);
+
+		for (; i < n; i++)
+			if (!(ptrs[i] = os_malloc(size)))
+				break;
+
+		return i;
+	}
+
+	struct arena *a = arena_get();
+
+	STAT_ADD(STAT_CLASSES + size_class(size), n);
+
+	pthread_mutex_lock(&a->lock);
+	remote_drain(a);
+
+	while (i < n) {
+		size_t count = n - i < per_block ? n - i : per_block;
+		char *out = heap_alloc(a, count * (size_aligned +
+							   SIZEOF_STRUCT_BLOCK_META) -
+							   SIZEOF_STRUCT_BLOCK_META, treshold);
+
+		if (!out)
+			break;
+
+		heap_carve(a, (struct block_meta *) out - 1, size_aligned, count,
+				   ptrs + i);
+
+		// only the last block may be bigger than asked for
+		STAT_ADD(STAT_HEAP + STAT_ALLOCS, count);
+		STAT_ADD(STAT_HEAP + STAT_ALLOC_BYTES, (count - 1) * size_aligned +
+				 ((struct block_meta *) ptrs[i + count - 1] - 1)->size);
+		i += count;
+	}
+
+	pthread_mutex_unlock(&a->lock);
+
+	// samples are taken without the lock, as taking one may allocate
+	for (size_t j = 0; j < i; j++) {
+		PROF_ALLOC(ptrs[j], size);
+		TRACE(TRACE_MALLOC, ptrs[j], NULL, size);
+	}
+
+	return i;
+}
+
+/* free the n blocks in ptrs at once; the lock of the calling thread's arena
+ * is only taken once for a run of its blocks
+ */
+void os_free_batch(void **ptrs, size_t n)
+{
+	struct arena *locked = NULL;
+
+	for (size_t i = 0; i < n; i++) {
+		if (!ptrs[i])
+			continue;
+
+		uintptr_t entry = pagemap_get(ptrs[i]);
+		struct block_meta *block = ((struct block_meta *) ptrs[i]) - 1;
+
+		if (PAGEMAP_KIND(entry) == PAGEMAP_HEAP)
+			BLOCK_VERIFY(block, entry);
+
+		if (PAGEMAP_KIND(entry) == PAGEMAP_HEAP &&
+			block->status == STATUS_ALLOC &&
+			PAGEMAP_PTR(entry) == thread_arena) {
+			// tracing and sampling may allocate, so a block they see is
+			// freed without the lock held; they come before the free, like
+			// in os_free(), as the block may be reused as soon as it is
+			if (locked && (__atomic_load_n(&trace_on, __ATOMIC_RELAXED) ||
+						   PROF_TRACKED(ptrs[i]))) {
+				pthread_mutex_unlock(&locked->lock);
+				locked = NULL;
+			}
+
+			TRACE(TRACE_FREE, ptrs[i], NULL, 0);
+			PROF_FREE(ptrs[i]);
+
+			if (!locked) {
+				locked = thread_arena;
+				pthread_mutex_lock(&locked->lock);
+			}
+
+			STAT_FREE(STAT_HEAP, block->size);
+			heap_free(locked, block);
+			continue;
+		}
+
+		// everything else may take other locks, our arena's included
+		if (locked) {
+			pthread_mutex_unlock(&locked->lock);
+			locked = NULL;
+		}
+
+		os_free(ptrs[i]);
+	}
+
+	if (locked)
+		pthread_mutex_unlock(&locked->lock);
+}
+
+/* map a block whose payload is aligned to "alignment"; its header goes
+ * right before the first aligned address that leaves room for it, and
+ * keeps how far into the chunk it starts; returns NULL if there is no
+ * memory left
+ */
+struct block_meta *mapped_memalign(struct arena *a, size_t alignment,
+								   size_t size)
+{
+	size_t len = PAGE_ALIGN(size + alignment + SIZEOF_STRUCT_BLOCK_META);
+	char *chunk = mmap_cache_get(&len, a->node);
+	uintptr_t payload;
+
+	if (chunk) {
+		STAT_ADD(STAT_MMAP_CACHE_HIT, 1);
+		payload = ALIGN_UP((uintptr_t) chunk + SIZEOF_STRUCT_BLOCK_META,
+						   alignment);
+	} else {
+		chunk = mmap(NULL, len, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (chunk == MAP_FAILED)
+			return NULL;
+
+		STAT_ADD(STAT_MMAP, 1);
+
+		// a fresh chunk gives back the whole pages it does not need around
+		// the block, which are many for alignments bigger than a page
+		payload = ALIGN_UP((uintptr_t) chunk + SIZEOF_STRUCT_BLOCK_META,
+						   alignment);
+
+		size_t lead = PAGE_TRUNC(payload - SIZEOF_STRUCT_BLOCK_META -
+								 (uintptr_t) chunk);
+		char *end = (char *) PAGE_ALIGN(payload + size);
+
+		if (lead) {
+			int res = munmap(chunk, lead);
+
+			DIE(res == -1, "munmap failed");
+			chunk += lead;
+			len -= lead;
+		}
+
+		if (end < chunk + len) {
+			int res = munmap(end, chunk + len - end);
+
+			DIE(res == -1, "munmap failed");
+			len = end - chunk;
+		}
+
+		numa_bind(chunk, len, a->node);
+	}
+
+	struct block_meta *block = (struct block_meta *) payload - 1;
+
+	*block = (struct block_meta) {
+		.offset = (char *) block - chunk,
+		.status = STATUS_MAPPED,
+		.node = a->node,
+		.size = (uintptr_t) chunk + len - payload,
+	};
+	BLOCK_SEAL(block);
+	mapped_pagemap(block, (uintptr_t) block | PAGEMAP_MAPPED);
+
+	return block;
+}
+
+/* allocate an aligned size from the list of an arena, with its payload
+ * aligned to "alignment"; the space in front of the aligned payload is
+ * given back as a free block; the arena lock must be held
+ */
+void *heap_memalign(struct arena *a, size_t alignment, size_t size_aligned,
+					size_t treshold)
+{
+	// there is room for the aligned payload at most alignment bytes in,
+	// plus a free block in front of it
+	char *out = heap_alloc(a, size_aligned + alignment +
+						   SIZEOF_STRUCT_BLOCK_META + MIN_PAYLOAD, treshold);
+
+	if (!out)
+		return NULL;
+
+	struct block_meta *block = (struct block_meta *) out - 1;
+
+	// a size too close to the treshold may have been mapped on its own; it
+	// is not a heap block to be carved, os_memalign() maps those itself
+	if (block->status == STATUS_MAPPED) {
+		mapped_free(block);
+		return NULL;
+	}
+
+	uintptr_t payload = ALIGN_UP((uintptr_t) out, alignment);
+
+	block->zero = 0;
+
+	if (payload != (uintptr_t) out) {
+		// the block in front has to be big enough to be on its own
+		if (payload - (uintptr_t) out < SIZEOF_STRUCT_BLOCK_META + MIN_PAYLOAD)
+			payload += alignment;
+
+		struct block_meta *aligned = (struct block_meta *) payload - 1;
+
+		*aligned = (struct block_meta) {
+			.prev_size = (char *) aligned - (char *) out,
+			.status = STATUS_ALLOC,
+			.size = (char *) BLOCK_END(block) - (char *) payload,
+		};
+		BLOCK_SEAL(aligned);
+
+		if (a->mem_end == block)
+			a->mem_end = aligned;
+		else
+			block_link(a, aligned);
+
+		block->size = (char *) aligned - (char *) out;
+		heap_free(a, block);
+
+		block = aligned;
+	}
+
+	// give the tail back as well
+	if (split_fits(a, block, size_aligned))
+		split_block(a, block, size_aligned);
+
+	return block + 1;
+}
+
+/* allocate "size" bytes whose address is a multiple of "alignment", which
+ * has to be a power of two
+ */
+void *os_memalign(size_t alignment, size_t size)
+{
+	if (!alignment || (alignment & (alignment - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	// every block is already aligned this much
+	if (alignment <= ALIGNMENT)
+		return os_malloc(size);
+
+	if (!size)
+		return NULL;
+
+	if (size > SIZE_MAX / 2 - alignment) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	size_t size_aligned = ALIGN16(size);
+
+	if (size_aligned < MIN_PAYLOAD)
+		size_aligned = MIN_PAYLOAD;
+
+	// blocks that are too big for the list, with what is needed to align
+	// them, are mapped on their own and do not need the lock; the bound is
+	// the one heap_alloc() keeps on the heap
+	struct arena *a = arena_get();
+	size_t treshold = __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+
+	STAT_ADD(STAT_CLASSES + size_class(size), 1);
+
+	if (size_aligned + alignment + SIZEOF_STRUCT_BLOCK_META + MIN_PAYLOAD >=
+		treshold - SIZEOF_STRUCT_BLOCK_META) {
+		struct block_meta *block = mapped_memalign(a, alignment, size_aligned);
+
+		if (!block)
+			return NULL;
+
+		STAT_ALLOC(STAT_MAPPED, block->size);
+		PROF_ALLOC(block + 1, size);
+		TRACE(TRACE_MEMALIGN, block + 1, (void *) alignment, size);
+		return block + 1;
+	}
+
+	pthread_mutex_lock(&a->lock);
+	remote_drain(a);
+	void *out = heap_memalign(a, alignment, size_aligned, treshold);
+
+	pthread_mutex_unlock(&a->lock);
+
+	if (out) {
+		STAT_ALLOC(STAT_HEAP, ((struct block_meta *) out - 1)->size);
+		PROF_ALLOC(out, size);
+	}
+
+	TRACE(TRACE_MEMALIGN, out, (void *) alignment, size);
+
+	return out;
+}
+
+/* C11 aligned_alloc(), the same as os_memalign() */
+void *os_aligned_alloc(size_t alignment, size_t size)
+{
+	return os_memalign(alignment, size);
+}
+
+/* POSIX posix_memalign(): the alignment also has to be a multiple of
+ * sizeof(void *); returns 0, EINVAL or ENOMEM, and never changes errno
+ */
+int os_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	if (!alignment || alignment % sizeof(void *) ||
+		(alignment & (alignment - 1)))
+		return EINVAL;
+
+	int saved_errno = errno;
+	void *out = os_memalign(alignment, size);
+
+	if (!out && size) {
+		errno = saved_errno;
+		return ENOMEM;
+	}
+
+	*memptr = out;
+
+	return 0;
+}
+
+
+/* set one of the tunables of the allocator; returns 1 on success and 0 if
+ * the parameter or its value is not valid
+ */
+int os_mallopt(int param, size_t value)
+{
+	switch (param) {
+	// setting a treshold turns off its adjustment
+	case OS_M_MMAP_THRESHOLD:
+	case OS_M_CALLOC_MMAP_THRESHOLD:
+		if (value > MMAP_THRESHOLD_MAX)
+			return 0;
+
+		// a block must fit in the treshold with its block_meta
+		if (value <= SIZEOF_STRUCT_BLOCK_META + MIN_PAYLOAD)
+			value = SIZEOF_STRUCT_BLOCK_META + MIN_PAYLOAD + 1;
+
+		if (param == OS_M_MMAP_THRESHOLD) {
+			__atomic_store_n(&mmap_threshold_fixed, 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&mmap_threshold, value, __ATOMIC_RELAXED);
+		} else {
+			__atomic_store_n(&calloc_threshold_fixed, 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&calloc_threshold, value, __ATOMIC_RELAXED);
+		}
+
+		return 1;
+
+	case OS_M_TRIM_THRESHOLD:
+		__atomic_store_n(&trim_threshold_fixed, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&trim_threshold, value, __ATOMIC_RELAXED);
+		return 1;
+
+	case OS_M_TOP_PAD:
+		__atomic_store_n(&top_pad, value, __ATOMIC_RELAXED);
+		return 1;
+
+	case OS_M_HUGE_PAGES:
+		if (value > OS_HUGE_TLB)
+			return 0;
+
+		__atomic_store_n(&huge_pages, value, __ATOMIC_RELAXED);
+		return 1;
+
+	case OS_M_MMAP_CACHE_MAX:
+		mmap_cache_set_max(value);
+		return 1;
+
+	case OS_M_MMAP_CACHE_DECAY_MS:
+		mmap_cache_set_decay(value);
+		return 1;
+
+	case OS_M_PROF_SAMPLE:
+		prof_set_rate(value);
+		return 1;
+
+	case OS_M_FIT_POLICY:
+		if (value > OS_FIT_NEXT)
+			return 0;
+
+		__atomic_store_n(&fit_policy, value, __ATOMIC_RELAXED);
+		return 1;
+
+	// a split always leaves a payload of MIN_PAYLOAD
+	case OS_M_SPLIT_MIN:
+		if (value > MMAP_THRESHOLD_MAX)
+			return 0;
+
+		value = value < MIN_PAYLOAD ? MIN_PAYLOAD : ALIGN16(value);
+		__atomic_store_n(&split_min, value, __ATOMIC_RELAXED);
+		return 1;
+
+	// the purge thread starts with the first decay time, and stops with 0
+	case OS_M_DECAY_MS:
+		return decay_set(value);
+
+	// the blocks already in the fast bins are still reused and merged
+	case OS_M_FAST_MAX:
+		if (value > FAST_LIMIT)
+			return 0;
+
+		__atomic_store_n(&fast_max, value, __ATOMIC_RELAXED);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* give free memory back to the system: the free pages of every arena, the
+ * top of every heap except for "pad" bytes, and the mapped chunk cache;
+ * returns 1 if anything was released
+ */
+int os_malloc_trim(size_t pad)
+{
+	int released = 0;
+
+	pthread_once(&arenas_once, arenas_init);
+
+	for (unsigned int i = 0; i < narenas; i++) {
+		struct arena *a = &arenas[i];
+
+		pthread_mutex_lock(&a->lock);
+		remote_drain(a);
+		released |= arena_trim(a, pad);
+		pthread_mutex_unlock(&a->lock);
+	}
+
+	released |= mmap_cache_flush();
+
+	return released;
 }
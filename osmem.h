@@ -9,5 +9,89 @@
 
 void *os_malloc(size_t size);
 void os_free(void *ptr);
+void os_free_sized(void *ptr, size_t size);
+size_t os_malloc_usable_size(void *ptr);
+size_t os_malloc_batch(size_t size, size_t n, void **ptrs);
+void os_free_batch(void **ptrs, size_t n);
+void *os_malloc_onnode(size_t size, int node);
 void *os_calloc(size_t nmemb, size_t size);
 void *os_realloc(void *ptr, size_t size);
+void *os_memalign(size_t alignment, size_t size);
+void *os_aligned_alloc(size_t alignment, size_t size);
+int os_posix_memalign(void **memptr, size_t alignment, size_t size);
+
+/* os_mallopt() parameters */
+#define OS_M_MMAP_THRESHOLD			1
+#define OS_M_CALLOC_MMAP_THRESHOLD	2
+#define OS_M_MMAP_CACHE_MAX			3
+#define OS_M_MMAP_CACHE_DECAY_MS	4
+#define OS_M_TRIM_THRESHOLD			5
+#define OS_M_HUGE_PAGES				6
+#define OS_M_PROF_SAMPLE			7
+#define OS_M_FIT_POLICY				8
+#define OS_M_SPLIT_MIN				9
+#define OS_M_FAST_MAX				10
+#define OS_M_DECAY_MS				11
+#define OS_M_TOP_PAD				12
+
+/* OS_M_HUGE_PAGES values */
+#define OS_HUGE_OFF		0
+#define OS_HUGE_THP		1
+#define OS_HUGE_TLB		2
+
+/* OS_M_FIT_POLICY values */
+#define OS_FIT_BEST		0
+#define OS_FIT_GOOD		1
+#define OS_FIT_FIRST	2
+#define OS_FIT_NEXT		3
+
+int os_mallopt(int param, size_t value);
+int os_malloc_trim(size_t pad);
+int os_malloc_prof_dump(const char *path);
+int os_malloc_prof_signal(int signo, const char *path);
+int os_malloc_trace_start(const char *path);
+int os_malloc_trace_stop(void);
+
+/* what os_mallinfo() reports; the heap fields come from a walk of the lists
+ * of the arenas, the others from the counters of the threads
+ */
+struct os_mallinfo {
+	size_t arena;			/* bytes in the heaps of the arenas */
+	size_t ordblks;			/* free heap blocks */
+	size_t fordblks;		/* free heap bytes */
+	size_t uordblks;		/* allocated heap bytes */
+	size_t largest;			/* bytes of the largest free heap block */
+	size_t fragmentation;	/* % of free heap bytes not in the largest */
+	size_t smblks;			/* live slab objects */
+	size_t smblkhd;			/* bytes of live slab objects */
+	size_t slab;			/* bytes in the slabs */
+	size_t hblks;			/* live mapped blocks */
+	size_t hblkhd;			/* bytes of live mapped blocks */
+	size_t cached;			/* bytes in the mapped chunk cache */
+	size_t nmalloc;			/* allocations */
+	size_t nfree;			/* frees */
+	size_t nrealloc;		/* calls to os_realloc() */
+	size_t nsplit;			/* blocks split */
+	size_t ncoalesce;		/* blocks merged */
+	size_t nmmap;			/* chunks mapped */
+	size_t nmunmap;			/* chunks unmapped */
+	size_t nmremap;			/* chunks remapped */
+	size_t ncommit;			/* region commits */
+	size_t ndecommit;		/* region decommits */
+	size_t npurge;			/* free blocks whose pages were given back */
+	size_t nremote;			/* frees pushed to another arena */
+	size_t fsmblks;			/* free heap bytes in the fast bins */
+	size_t nfast;			/* allocations served by a fast bin */
+};
+
+struct os_mallinfo os_mallinfo(void);
+size_t os_malloc_histogram(size_t *sizes, size_t *counts, size_t n);
+void os_malloc_stats(void);
+
+/* bump allocation for memory that is all freed at once, see bump.c */
+struct os_arena;
+
+struct os_arena *os_arena_create(size_t chunk_size);
+void *os_arena_alloc(struct os_arena *arena, size_t size);
+void os_arena_reset(struct os_arena *arena);
+void os_arena_destroy(struct os_arena *arena);
@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "helpers.h"
+
+#define PAGEMAP_SHIFT 12
+#define PAGEMAP_BITS 12
+#define PAGEMAP_FANOUT (1UL << PAGEMAP_BITS)
+#define PAGEMAP_LEVEL(page, level) \
+	(((page) >> ((level) * PAGEMAP_BITS)) & (PAGEMAP_FANOUT - 1))
+
+
+// three level radix tree over the 36 bits of a 48-bit address page number;
+// the leaves hold one entry for every 4 KiB page
+uintptr_t **pagemap_root[PAGEMAP_FANOUT];
+pthread_mutex_t pagemap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* map a zeroed node of the radix tree */
+void *pagemap_node(void)
+{
+	void *node = mmap(NULL, PAGEMAP_FANOUT * sizeof(void *),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	DIE(node == MAP_FAILED, "mmap failed");
+
+	return node;
+}
+
+/* get the leaf entry of a page, creating the path to it if needed */
+uintptr_t *pagemap_slot(uintptr_t page)
+{
+	uintptr_t ***root = &pagemap_root[PAGEMAP_LEVEL(page, 2)];
+	uintptr_t **mid = __atomic_load_n(root, __ATOMIC_ACQUIRE);
+
+	// nodes are only ever added, so readers never need the lock
+	if (!mid) {
+		pthread_mutex_lock(&pagemap_lock);
+
+		mid = *root;
+		if (!mid) {
+			mid = pagemap_node();
+			__atomic_store_n(root, mid, __ATOMIC_RELEASE);
+		}
+
+		pthread_mutex_unlock(&pagemap_lock);
+	}
+
+	uintptr_t **leaf_slot = &mid[PAGEMAP_LEVEL(page, 1)];
+	uintptr_t *leaf = __atomic_load_n(leaf_slot, __ATOMIC_ACQUIRE);
+
+	if (!leaf) {
+		pthread_mutex_lock(&pagemap_lock);
+
+		leaf = *leaf_slot;
+		if (!leaf) {
+			leaf = pagemap_node();
+			__atomic_store_n(leaf_slot, leaf, __ATOMIC_RELEASE);
+		}
+
+		pthread_mutex_unlock(&pagemap_lock);
+	}
+
+	return &leaf[PAGEMAP_LEVEL(page, 0)];
+}
+
+/* set the entry of every page that overlaps [start, start + len) */
+void pagemap_set(void *start, size_t len, uintptr_t entry)
+{
+	uintptr_t first = (uintptr_t) start >> PAGEMAP_SHIFT;
+	uintptr_t last = ((uintptr_t) start + len - 1) >> PAGEMAP_SHIFT;
+
+	for (uintptr_t page = first; page <= last; page++)
+		__atomic_store_n(pagemap_slot(page), entry, __ATOMIC_RELEASE);
+}
+
+/* get the entry of the page holding ptr, or 0 if it is not ours */
+uintptr_t pagemap_get(void *ptr)
+{
+	uintptr_t page = (uintptr_t) ptr >> PAGEMAP_SHIFT;
+
+	if (page >> (3 * PAGEMAP_BITS))
+		return 0;
+
+	uintptr_t **mid = __atomic_load_n(&pagemap_root[PAGEMAP_LEVEL(page, 2)],
+							__ATOMIC_ACQUIRE);
+
+	if (!mid)
+		return 0;
+
+	uintptr_t *leaf = __atomic_load_n(&mid[PAGEMAP_LEVEL(page, 1)],
+							__ATOMIC_ACQUIRE);
+
+	if (!leaf)
+		return 0;
+
+	return __atomic_load_n(&leaf[PAGEMAP_LEVEL(page, 0)], __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,399 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <execinfo.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+
+#include "osmem.h"
+#include "helpers.h"
+
+// how many bytes a thread allocates between two looks at the sampling rate
+// while sampling is off
+#define PROF_IDLE (1024 * 1024)
+
+// records are mapped this many bytes at a time
+#define PROF_POOL_CHUNK (64 * 1024)
+
+
+// a sample is taken on average every prof_rate bytes allocated, 0 turns
+// sampling off; PROF_SAMPLE can be set when building
+#ifndef PROF_SAMPLE
+#define PROF_SAMPLE 0
+#endif
+
+size_t prof_rate = PROF_SAMPLE;
+
+// every thread counts down the bytes left until its next sample; it is
+// armed once it has drawn a distance with sampling on
+__thread int64_t prof_left;
+__thread int prof_armed;
+__thread int prof_busy;
+__thread uint64_t prof_seed;
+
+// the live samples, by address; a free only takes the lock if the bucket
+// of its pointer is not empty
+struct prof_sample *prof_table[PROF_BUCKETS];
+struct prof_sample *prof_pool;
+pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// a signal only asks for a dump, which is written by the next thread that
+// takes a sample, outside of the signal handler
+char prof_signal_path[256];
+int prof_dump_pending;
+
+
+/* approximate log2(x), for 0 < x <= 1, without libm */
+double prof_log2(double x)
+{
+	union {
+		double d;
+		uint64_t u;
+	} bits = { .d = x };
+
+	// x = m * 2^e, with m in [1, 2)
+	int e = (int) ((bits.u >> 52) & 0x7ff) - 1023;
+
+	bits.u = (bits.u & ((1ULL << 52) - 1)) | (1023ULL << 52);
+
+	double m = bits.d;
+
+	// a quadratic fit of log2(m), good to 0.005
+	return e + (-0.34484843 * m + 2.02466578) * m - 1.67487759;
+}
+
+/* draw the number of bytes until the next sample, from an exponential
+ * distribution of mean prof_rate, so the samples form a Poisson process
+ */
+int64_t prof_next(size_t rate)
+{
+	// xorshift, seeded from the address of the thread's own state
+	if (!prof_seed)
+		prof_seed = (uintptr_t) &prof_seed * 0x9E3779B97F4A7C15ULL | 1;
+
+	prof_seed ^= prof_seed << 13;
+	prof_seed ^= prof_seed >> 7;
+	prof_seed ^= prof_seed << 17;
+
+	// u is in (0, 1]
+	double u = ((prof_seed >> 11) + 1) / 9007199254740992.0;
+	double next = -prof_log2(u) * 0.69314718055994530942 * rate;
+
+	return next < 1 ? 1 : (int64_t) next;
+}
+
+/* take a record out of the pool, mapping more if it is empty;
+ * the profiler lock must be held
+ */
+struct prof_sample *prof_record_get(void)
+{
+	if (!prof_pool) {
+		struct prof_sample *chunk = mmap(NULL, PROF_POOL_CHUNK,
+										 PROT_READ | PROT_WRITE,
+										 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (chunk == MAP_FAILED)
+			return NULL;
+
+		for (size_t i = 0; i < PROF_POOL_CHUNK / sizeof(*chunk); i++) {
+			chunk[i].next = prof_pool;
+			prof_pool = &chunk[i];
+		}
+	}
+
+	struct prof_sample *sample = prof_pool;
+
+	prof_pool = sample->next;
+
+	return sample;
+}
+
+/* add a sample to the table; the profiler lock must be held */
+void prof_insert(struct prof_sample *sample)
+{
+	struct prof_sample **bucket = &prof_table[PROF_HASH(sample->ptr)];
+
+	sample->next = *bucket;
+	__atomic_store_n(bucket, sample, __ATOMIC_RELAXED);
+}
+
+/* the bytes left until the next sample of the calling thread have run
+ * out: take a sample of the allocation at ptr if sampling is on
+ */
+void prof_sample(void *ptr, size_t size)
+{
+	size_t rate = __atomic_load_n(&prof_rate, __ATOMIC_RELAXED);
+
+	// allocations made while a sample is being taken are not sampled
+	if (prof_busy)
+		return;
+
+	prof_busy = 1;
+
+	if (__atomic_exchange_n(&prof_dump_pending, 0, __ATOMIC_RELAXED))
+		os_malloc_prof_dump(prof_signal_path);
+
+	// a thread that was not armed only draws its first distance
+	if (!rate || !prof_armed) {
+		prof_armed = rate != 0;
+		prof_left = rate ? prof_next(rate) : PROF_IDLE;
+		prof_busy = 0;
+		return;
+	}
+
+	prof_left = prof_next(rate);
+
+	void *frames[PROF_DEPTH + 2];
+	int depth = backtrace(frames, PROF_DEPTH + 2);
+
+	pthread_mutex_lock(&prof_lock);
+
+	struct prof_sample *sample = prof_record_get();
+
+	if (sample) {
+		sample->ptr = ptr;
+		sample->size = size;
+
+		// the frames of the profiler and of the allocator are left out
+		sample->depth = depth > 2 ? depth - 2 : 0;
+		memcpy(sample->frames, frames + 2,
+			   sample->depth * sizeof(sample->frames[0]));
+
+		prof_insert(sample);
+	}
+
+	pthread_mutex_unlock(&prof_lock);
+
+	prof_busy = 0;
+}
+
+/* take the sample of a block out of the table, if it has one */
+struct prof_sample *prof_take(void *ptr)
+{
+	struct prof_sample *sample = NULL;
+
+	pthread_mutex_lock(&prof_lock);
+
+	for (struct prof_sample **p = &prof_table[PROF_HASH(ptr)]; *p;
+		 p = &(*p)->next) {
+		if ((*p)->ptr == ptr) {
+			sample = *p;
+			__atomic_store_n(p, sample->next, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&prof_lock);
+
+	return sample;
+}
+
+/* give the record of a sample back to the pool */
+void prof_release(struct prof_sample *sample)
+{
+	pthread_mutex_lock(&prof_lock);
+	sample->next = prof_pool;
+	prof_pool = sample;
+	pthread_mutex_unlock(&prof_lock);
+}
+
+/* a freed block stops being tracked */
+void prof_free(void *ptr)
+{
+	struct prof_sample *sample = prof_take(ptr);
+
+	if (sample)
+		prof_release(sample);
+}
+
+/* keep tracking a sample taken out by os_realloc(), where the block ended
+ * up; a block that was sampled again on the way keeps its new sample
+ */
+void prof_move(struct prof_sample *sample, void *ptr, size_t size)
+{
+	pthread_mutex_lock(&prof_lock);
+
+	struct prof_sample *again = prof_table[PROF_HASH(ptr)];
+
+	while (again && again->ptr != ptr)
+		again = again->next;
+
+	if (!again) {
+		sample->ptr = ptr;
+		sample->size = size;
+		prof_insert(sample);
+	}
+
+	pthread_mutex_unlock(&prof_lock);
+
+	if (again)
+		prof_release(sample);
+}
+
+/* buffered output for the dump, written with write() */
+struct prof_out {
+	int fd;
+	int len;
+	int error;
+	char buf[4096];
+};
+
+void prof_flush(struct prof_out *out)
+{
+	char *p = out->buf;
+
+	while (out->len > 0 && !out->error) {
+		ssize_t res = write(out->fd, p, out->len);
+
+		if (res < 0) {
+			if (errno != EINTR)
+				out->error = errno;
+			continue;
+		}
+
+		p += res;
+		out->len -= res;
+	}
+
+	out->len = 0;
+}
+
+void prof_printf(struct prof_out *out, const char *fmt, ...)
+{
+	va_list args;
+
+	if (sizeof(out->buf) - out->len < 256)
+		prof_flush(out);
+
+	va_start(args, fmt);
+	int len = vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len,
+						fmt, args);
+	va_end(args);
+
+	if (len > 0)
+		out->len += len < (int) (sizeof(out->buf) - out->len) ?
+					len : (int) (sizeof(out->buf) - out->len) - 1;
+}
+
+/* write the live samples to "path" as a pprof legacy heap profile, followed
+ * by the mappings of the process, which pprof needs for the symbols;
+ * returns 0, or -1 with errno set
+ */
+int os_malloc_prof_dump(const char *path)
+{
+	static struct prof_out out;
+	size_t count = 0, bytes = 0;
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (fd == -1)
+		return -1;
+
+	// the buffer is too big for the stack of every thread, so dumps are
+	// written one at a time
+	pthread_mutex_lock(&prof_lock);
+
+	out.fd = fd;
+	out.len = 0;
+	out.error = 0;
+
+	for (size_t i = 0; i < PROF_BUCKETS; i++) {
+		for (struct prof_sample *s = prof_table[i]; s; s = s->next) {
+			count++;
+			bytes += s->size;
+		}
+	}
+
+	// pprof unsamples the counts itself, from the sampling rate
+	prof_printf(&out, "heap profile: %zu: %zu [ %zu: %zu] @ heap_v2/%zu\n",
+				count, bytes, count, bytes,
+				__atomic_load_n(&prof_rate, __ATOMIC_RELAXED));
+
+	for (size_t i = 0; i < PROF_BUCKETS; i++) {
+		for (struct prof_sample *s = prof_table[i]; s; s = s->next) {
+			prof_printf(&out, "%6d: %8zu [%6d: %8zu] @", 1, s->size, 1,
+						s->size);
+
+			for (int j = 0; j < s->depth; j++)
+				prof_printf(&out, " %p", s->frames[j]);
+
+			prof_printf(&out, "\n");
+		}
+	}
+
+	prof_printf(&out, "\nMAPPED_LIBRARIES:\n");
+	prof_flush(&out);
+
+	int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+
+	if (maps != -1) {
+		ssize_t len;
+
+		while (!out.error &&
+			   (len = read(maps, out.buf, sizeof(out.buf))) > 0) {
+			out.len = len;
+			prof_flush(&out);
+		}
+
+		close(maps);
+	}
+
+	int error = out.error;
+
+	pthread_mutex_unlock(&prof_lock);
+
+	if (close(fd) == -1 && !error)
+		error = errno;
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
+void prof_signal_handler(int signo)
+{
+	(void) signo;
+
+	__atomic_store_n(&prof_dump_pending, 1, __ATOMIC_RELAXED);
+}
+
+/* dump a profile to "path" every time the process gets the signal signo;
+ * the dump is written by the next thread that takes a sample;
+ * returns 0, or -1 with errno set
+ */
+int os_malloc_prof_signal(int signo, const char *path)
+{
+	struct sigaction sa = {0};
+
+	if (strlen(path) >= sizeof(prof_signal_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	strcpy(prof_signal_path, path);
+
+	sa.sa_handler = prof_signal_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+
+	return sigaction(signo, &sa, NULL);
+}
+
+/* turn sampling on, with a sample every "rate" bytes on average, or off */
+void prof_set_rate(size_t rate)
+{
+	// backtrace() loads what it needs the first time it is called, which
+	// may allocate; that is better done now than while taking a sample
+	if (rate) {
+		void *frame;
+
+		prof_busy = 1;
+		backtrace(&frame, 1);
+		prof_busy = 0;
+	}
+
+	__atomic_store_n(&prof_rate, rate, __ATOMIC_RELAXED);
+}
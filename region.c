@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "helpers.h"
+
+// memory is committed this much at a time, or a huge page at a time for
+// regions backed by huge pages
+#define REGION_COMMIT (256 * 1024)
+
+#define STEP_ALIGN(addr, step) ((char *) (((uintptr_t) (addr) + (step) - 1) & \
+							~((uintptr_t) (step) - 1)))
+
+
+/* get how much of a region is committed or decommitted at a time */
+size_t region_step(struct region *r)
+{
+	if (r->huge && __atomic_load_n(&huge_pages, __ATOMIC_RELAXED))
+		return HUGE_PAGE_SIZE;
+
+	return REGION_COMMIT;
+}
+
+/* reserve "size" bytes of addresses for a region, aligned to a huge page,
+ * without committing any of them
+ */
+void region_init(struct region *r, size_t size, int huge)
+{
+	char *res = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	DIE(res == MAP_FAILED, "mmap failed");
+
+	r->base = (char *) (((uintptr_t) res + HUGE_PAGE_SIZE - 1) &
+						~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+	r->brk = r->base;
+	r->commit = r->base;
+	r->clean = r->base;
+	r->end = r->base + size;
+	r->huge = huge;
+	r->node = -1;
+}
+
+/* make the pages of a region come from the given NUMA node */
+void region_bind(struct region *r, int node)
+{
+	r->node = node;
+	numa_bind(r->base, r->end - r->base, node);
+}
+
+/* hand out the next "len" bytes of a region, committing them if needed;
+ * *zero is set if they are known to be zeroed; returns NULL if the region
+ * is full
+ */
+void *region_grow(struct region *r, size_t len, int *zero)
+{
+	char *out = r->brk;
+
+	if ((size_t) (r->end - r->brk) < len)
+		return NULL;
+
+	if (r->brk + len > r->commit) {
+		size_t step = region_step(r);
+		char *commit = STEP_ALIGN(r->brk + len, step);
+
+		if (commit > r->end)
+			commit = r->end;
+
+		int res = mprotect(r->commit, commit - r->commit,
+						   PROT_READ | PROT_WRITE);
+
+		DIE(res == -1, "mprotect failed");
+		STAT_ADD(STAT_COMMIT, 1);
+
+		// this fails if transparent huge pages are turned off, the memory
+		// can still be used
+		if (step == HUGE_PAGE_SIZE)
+			madvise(r->commit, commit - r->commit, MADV_HUGEPAGE);
+
+		r->commit = commit;
+	}
+
+	*zero = out >= r->clean;
+	r->brk += len;
+
+	if (r->clean < r->brk)
+		r->clean = r->brk;
+
+	return out;
+}
+
+/* give the last "len" bytes handed out of a region back; with "all", the
+ * whole pages, or huge pages, past the new end are decommitted, otherwise
+ * only the steps of region_step() past the one after the new end, so a
+ * region that shrinks and grows back over the same step boundary is not
+ * decommitted and committed every time
+ */
+void region_shrink(struct region *r, size_t len, int all)
+{
+	size_t step = region_step(r);
+	char *keep;
+
+	r->brk -= len;
+
+	if (all)
+		keep = STEP_ALIGN(r->brk, step == HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE :
+						  (size_t) getpagesize());
+	else
+		keep = STEP_ALIGN(r->brk, step) + step;
+
+	if (keep >= r->commit)
+		return;
+
+	// mapping the range again drops its pages and its commit charge
+	void *res = mmap(keep, r->commit - keep, PROT_NONE, MAP_PRIVATE |
+					 MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+
+	DIE(res == MAP_FAILED, "mmap failed");
+	STAT_ADD(STAT_DECOMMIT, 1);
+
+	// the new mapping does not keep the policy of the old one
+	numa_bind(keep, r->commit - keep, r->node);
+
+	r->commit = keep;
+	r->clean = keep;
+}
@@ -0,0 +1,275 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <malloc.h>
+
+#include "osmem.h"
+#include "helpers.h"
+
+// allocations made while the allocator is already running on the same
+// thread, by the C library functions it calls (sysconf(), pthread_once(),
+// backtrace(), ...), are served from this buffer, so nothing waits for a
+// lock the thread holds or for an initialization it is in the middle of;
+// SHIM_BOOT_SIZE can be set when building
+#ifndef SHIM_BOOT_SIZE
+#define SHIM_BOOT_SIZE (256 * 1024)
+#endif
+
+// the size of a bootstrap allocation is kept in front of it, for realloc()
+#define SHIM_BOOT_HEADER 16
+
+__thread int shim_depth;
+char shim_boot[SHIM_BOOT_SIZE] __attribute__((aligned(SHIM_BOOT_HEADER)));
+size_t shim_boot_used;
+
+
+/* allocate from the bootstrap buffer, aligned to at least 16 bytes;
+ * nothing in it is ever freed
+ */
+void *shim_boot_alloc(size_t alignment, size_t size)
+{
+	uintptr_t base = (uintptr_t) shim_boot;
+	size_t used = __atomic_load_n(&shim_boot_used, __ATOMIC_RELAXED);
+	size_t start, end;
+
+	if (alignment < SHIM_BOOT_HEADER)
+		alignment = SHIM_BOOT_HEADER;
+
+	do {
+		start = ((base + used + SHIM_BOOT_HEADER + alignment - 1) &
+				 ~(alignment - 1)) - base;
+		end = start + ((size + 15) & ~15UL);
+
+		if (size > SHIM_BOOT_SIZE || end > SHIM_BOOT_SIZE) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	} while (!__atomic_compare_exchange_n(&shim_boot_used, &used, end, 1,
+										  __ATOMIC_RELAXED,
+										  __ATOMIC_RELAXED));
+
+	*(size_t *) (shim_boot + start - SHIM_BOOT_HEADER) = size;
+
+	return shim_boot + start;
+}
+
+/* whether ptr is in the bootstrap buffer */
+int shim_boot_owns(void *ptr)
+{
+	return (char *) ptr >= shim_boot && (char *) ptr < shim_boot +
+		   SHIM_BOOT_SIZE;
+}
+
+/* get the size a bootstrap allocation was asked for */
+size_t shim_boot_size(void *ptr)
+{
+	return *(size_t *) ((char *) ptr - SHIM_BOOT_HEADER);
+}
+
+/* the exported functions below stand in for the ones of the C library, so
+ * a program runs on this allocator with LD_PRELOAD=libosmem.so; they differ
+ * from the os_*() functions where the C library has to be copied, like
+ * malloc(0) returning a pointer that can be freed
+ */
+void *malloc(size_t size)
+{
+	if (shim_depth)
+		return shim_boot_alloc(0, size);
+
+	shim_depth++;
+	void *ptr = os_malloc(size ? size : 1);
+
+	shim_depth--;
+
+	if (!ptr)
+		errno = ENOMEM;
+
+	return ptr;
+}
+
+void free(void *ptr)
+{
+	if (!ptr || shim_boot_owns(ptr))
+		return;
+
+	shim_depth++;
+	os_free(ptr);
+	shim_depth--;
+}
+
+/* free() of C23 that is told the size, which the sized operator deletes
+ * use to find slab objects without the page map
+ */
+void free_sized(void *ptr, size_t size)
+{
+	if (!ptr || shim_boot_owns(ptr))
+		return;
+
+	shim_depth++;
+	os_free_sized(ptr, size);
+	shim_depth--;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (size && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// the bootstrap buffer is never reused, so it is still zeroed
+	if (shim_depth)
+		return shim_boot_alloc(0, nmemb * size);
+
+	if (!nmemb || !size)
+		nmemb = size = 1;
+
+	shim_depth++;
+	void *ptr = os_calloc(nmemb, size);
+
+	shim_depth--;
+
+	if (!ptr)
+		errno = ENOMEM;
+
+	return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (!ptr)
+		return malloc(size);
+
+	// a bootstrap allocation moves into the allocator, or to a bigger
+	// bootstrap allocation; a block of the allocator resized from inside
+	// it moves to the bootstrap buffer and is leaked, as os_free() may
+	// wait for a lock the thread holds
+	if (shim_depth || shim_boot_owns(ptr)) {
+		size_t old = shim_boot_owns(ptr) ? shim_boot_size(ptr) :
+					 os_malloc_usable_size(ptr);
+
+		if (!size && !shim_depth) {
+			free(ptr);
+			return NULL;
+		}
+
+		void *newptr = malloc(size);
+
+		if (newptr)
+			memcpy(newptr, ptr, old < size ? old : size);
+
+		return newptr;
+	}
+
+	shim_depth++;
+	void *newptr = os_realloc(ptr, size);
+
+	shim_depth--;
+
+	if (!newptr && size)
+		errno = ENOMEM;
+
+	return newptr;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	if (shim_depth) {
+		if (!alignment || (alignment & (alignment - 1))) {
+			errno = EINVAL;
+			return NULL;
+		}
+
+		return shim_boot_alloc(alignment, size);
+	}
+
+	shim_depth++;
+	void *ptr = os_memalign(alignment, size ? size : 1);
+
+	shim_depth--;
+
+	return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	if (!alignment || alignment % sizeof(void *) ||
+		(alignment & (alignment - 1)))
+		return EINVAL;
+
+	int saved_errno = errno;
+	void *ptr = memalign(alignment, size);
+
+	errno = saved_errno;
+
+	if (!ptr)
+		return ENOMEM;
+
+	*memptr = ptr;
+
+	return 0;
+}
+
+void *valloc(size_t size)
+{
+	return memalign(getpagesize(), size);
+}
+
+void *pvalloc(size_t size)
+{
+	size_t page = getpagesize();
+
+	if (size > SIZE_MAX - page) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+	if (ptr && shim_boot_owns(ptr))
+		return shim_boot_size(ptr);
+
+	return os_malloc_usable_size(ptr);
+}
+
+/* start the purge thread if OSMEM_DECAY_MS is set, and start tracing if
+ * OSMEM_TRACE is set, for programs run with LD_PRELOAD; every process
+ * writes to a file of its own, OSMEM_TRACE followed by its pid, as the
+ * variable is passed on to every program it runs
+ */
+__attribute__((constructor))
+void shim_init(void)
+{
+	const char *decay = getenv("OSMEM_DECAY_MS");
+	const char *prefix = getenv("OSMEM_TRACE");
+	char path[PATH_MAX];
+
+	if (decay && *decay &&
+		!os_mallopt(OS_M_DECAY_MS, strtoul(decay, NULL, 10)))
+		stats_print("osmem: cannot start the purge thread\n");
+
+	if (!prefix || !*prefix)
+		return;
+
+	snprintf(path, sizeof(path), "%s.%d", prefix, (int) getpid());
+
+	if (os_malloc_trace_start(path) == -1)
+		stats_print("osmem: cannot trace to %s: errno %d\n", path, errno);
+}
+
+/* write out the rest of a trace started by shim_init() */
+__attribute__((destructor))
+void shim_fini(void)
+{
+	const char *prefix = getenv("OSMEM_TRACE");
+
+	if (prefix && *prefix)
+		os_malloc_trace_stop();
+}
@@ -0,0 +1,205 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "helpers.h"
+
+#define SLAB_REGION (64UL * 1024 * 1024 * 1024)
+#define SLAB_HEADER ((sizeof(struct slab) + 15) & ~15UL)
+
+
+// every slab is carved out of the reserved region of its NUMA node, so a
+// pointer is a slab object if it falls inside one of them, and its slab
+// starts at the SLAB_SIZE aligned address below it
+struct region slab_regions[MAX_NODES];
+pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+// slabs that have been emptied and given back by their arena, kept by node
+struct slab *slab_pool[MAX_NODES];
+pthread_mutex_t slab_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* reserve the address ranges every slab is taken from, one for every node */
+void slab_region_init(void)
+{
+	// regions start on a huge page, which is a multiple of SLAB_SIZE
+	for (unsigned int i = 0; i < numa_nodes; i++) {
+		region_init(&slab_regions[i], SLAB_REGION, 0);
+		region_bind(&slab_regions[i], i);
+	}
+}
+
+/* get how many bytes of slabs have been committed so far */
+size_t slab_bytes(void)
+{
+	size_t bytes = 0;
+
+	pthread_mutex_lock(&slab_pool_lock);
+
+	for (unsigned int i = 0; i < numa_nodes; i++)
+		bytes += slab_regions[i].brk - slab_regions[i].base;
+
+	pthread_mutex_unlock(&slab_pool_lock);
+
+	return bytes;
+}
+
+/* get the slab a pointer belongs to, or NULL if it is not a slab object */
+struct slab *slab_of(void *ptr)
+{
+	char *p = ptr;
+
+	// nothing is a slab object before the regions are reserved
+	for (unsigned int i = 0; i < numa_nodes; i++) {
+		struct region *r = &slab_regions[i];
+
+		if (r->base && p >= r->base && p < r->end)
+			return (struct slab *) ((uintptr_t) p &
+									~(uintptr_t) (SLAB_SIZE - 1));
+	}
+
+	return NULL;
+}
+
+/* get a fresh slab of the given class for an arena */
+struct slab *slab_create(struct arena *a, unsigned int class)
+{
+	struct slab *s = NULL;
+	int fresh = 0;
+
+	pthread_once(&slab_once, slab_region_init);
+
+	// reuse an emptied slab of the node of the arena if there is one,
+	// otherwise commit the next slab of its region
+	pthread_mutex_lock(&slab_pool_lock);
+
+	if (slab_pool[a->node]) {
+		s = slab_pool[a->node];
+		slab_pool[a->node] = s->next;
+	} else {
+		s = region_grow(&slab_regions[a->node], SLAB_SIZE, &fresh);
+	}
+
+	pthread_mutex_unlock(&slab_pool_lock);
+
+	if (!s)
+		return NULL;
+
+	if (fresh) {
+		// every page of the slab leads to its header
+		pagemap_set(s, SLAB_SIZE, (uintptr_t) s | PAGEMAP_SLAB);
+	}
+
+	// every object of the new slab is free
+	s->next = NULL;
+	s->prev = NULL;
+	s->arena = a - arenas;
+	s->class = class;
+	s->size = SLAB_CLASS_SIZE(class);
+	s->nobjs = (SLAB_SIZE - SLAB_HEADER) / s->size;
+	s->nfree = s->nobjs;
+	s->hint = 0;
+
+	memset(s->free_map, 0, sizeof(s->free_map));
+	for (unsigned int i = 0; i < s->nobjs / 64; i++)
+		s->free_map[i] = ~0ULL;
+	if (s->nobjs % 64)
+		s->free_map[s->nobjs / 64] = (1ULL << (s->nobjs % 64)) - 1;
+
+	return s;
+}
+
+/* give an empty slab back to the pool, along with its pages */
+void slab_release(struct slab *s)
+{
+	// the pages stay committed, but they no longer take up memory
+	madvise(s, SLAB_SIZE, MADV_DONTNEED);
+
+	// it stays on the node of the arena it came from
+	int node = arenas[s->arena].node;
+
+	pthread_mutex_lock(&slab_pool_lock);
+	s->next = slab_pool[node];
+	slab_pool[node] = s;
+	pthread_mutex_unlock(&slab_pool_lock);
+}
+
+/* take a slab out of the partial list of its arena */
+void slab_unlink(struct arena *a, struct slab *s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		a->slabs[s->class] = s->next;
+
+	if (s->next)
+		s->next->prev = s->prev;
+}
+
+/* put a slab at the head of the partial list of its arena */
+void slab_link(struct arena *a, struct slab *s)
+{
+	s->prev = NULL;
+	s->next = a->slabs[s->class];
+
+	if (s->next)
+		s->next->prev = s;
+
+	a->slabs[s->class] = s;
+}
+
+/* allocate an object of the given class; the arena lock must be held */
+void *slab_alloc(struct arena *a, unsigned int class)
+{
+	struct slab *s = a->slabs[class];
+
+	// the partial list only holds slabs with free objects
+	if (!s) {
+		s = slab_create(a, class);
+
+		if (!s)
+			return NULL;
+
+		slab_link(a, s);
+	}
+
+	// every word before the hint is known to be full
+	while (!s->free_map[s->hint])
+		s->hint++;
+
+	unsigned int bit = __builtin_ctzll(s->free_map[s->hint]);
+
+	s->free_map[s->hint] &= ~(1ULL << bit);
+	s->nfree--;
+
+	// full slabs leave the list until one of their objects is freed
+	if (!s->nfree)
+		slab_unlink(a, s);
+
+	return (char *) s + SLAB_HEADER + (s->hint * 64 + bit) * s->size;
+}
+
+/* give an object back to its slab; the arena lock must be held */
+void slab_free(struct arena *a, struct slab *s, void *ptr)
+{
+	unsigned int idx = ((char *) ptr - (char *) s - SLAB_HEADER) / s->size;
+	unsigned int word = idx / 64;
+
+	if (HARDEN && (s->free_map[word] & (1ULL << (idx % 64))))
+		corrupt("double free", ptr);
+
+	s->free_map[word] |= 1ULL << (idx % 64);
+	s->nfree++;
+
+	if (word < s->hint)
+		s->hint = word;
+
+	// a full slab is available again
+	if (s->nfree == 1)
+		slab_link(a, s);
+
+	// an empty slab goes back to the pool, unless it is the only one
+	// left for its class
+	if (s->nfree == s->nobjs && (s->prev || s->next)) {
+		slab_unlink(a, s);
+		slab_release(s);
+	}
+}
@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdarg.h>
+
+#include "osmem.h"
+#include "helpers.h"
+
+// every thread counts what it does in its own counters, so counting never
+// takes a lock or shares a cache line; the counters of the threads are only
+// added up when someone asks for them, and the ones of the threads that
+// have exited are kept in stats_dead
+__thread struct thread_stats thread_stats;
+struct thread_stats *stats_threads;
+uint64_t stats_dead[STAT_COUNT];
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t stats_key;
+pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+
+/* leave the counters of an exiting thread behind */
+void stats_destroy(void *arg)
+{
+	struct thread_stats *ts = arg;
+
+	pthread_mutex_lock(&stats_lock);
+
+	if (ts->prev)
+		ts->prev->next = ts->next;
+	else
+		stats_threads = ts->next;
+
+	if (ts->next)
+		ts->next->prev = ts->prev;
+
+	for (unsigned int i = 0; i < STAT_COUNT; i++)
+		__atomic_fetch_add(&stats_dead[i], ts->counters[i], __ATOMIC_RELAXED);
+
+	// what the later destructors free is counted in stats_dead directly
+	ts->state = STATS_DEAD;
+
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_key_create(void)
+{
+	pthread_key_create(&stats_key, stats_destroy);
+}
+
+/* count for a thread that is not registered: the first time, register
+ * it, and once it is exiting, count in stats_dead
+ */
+void stats_add_slow(unsigned int stat, uint64_t n)
+{
+	struct thread_stats *ts = &thread_stats;
+
+	if (ts->state == STATS_DEAD) {
+		__atomic_fetch_add(&stats_dead[stat], n, __ATOMIC_RELAXED);
+		return;
+	}
+
+	pthread_once(&stats_once, stats_key_create);
+	pthread_setspecific(stats_key, ts);
+
+	pthread_mutex_lock(&stats_lock);
+
+	ts->prev = NULL;
+	ts->next = stats_threads;
+	if (ts->next)
+		ts->next->prev = ts;
+	stats_threads = ts;
+
+	ts->counters[stat] += n;
+	__atomic_store_n(&ts->state, STATS_LIVE, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* add up the counters of every thread, the exited ones included */
+void stats_sum(uint64_t *sum)
+{
+	pthread_mutex_lock(&stats_lock);
+
+	for (unsigned int i = 0; i < STAT_COUNT; i++)
+		sum[i] = __atomic_load_n(&stats_dead[i], __ATOMIC_RELAXED);
+
+	for (struct thread_stats *ts = stats_threads; ts; ts = ts->next)
+		for (unsigned int i = 0; i < STAT_COUNT; i++)
+			sum[i] += __atomic_load_n(&ts->counters[i], __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* get the smallest size of a size class, the opposite of size_class() */
+size_t stats_class_size(unsigned int idx)
+{
+	if (idx < SMALLBIN_LIMIT >> 3)
+		return idx << 3;
+
+	// two classes for every power of two from SMALLBIN_LIMIT on
+	size_t log = 8 + ((idx - 32) >> 1);
+
+	return (1UL << log) + ((idx & 1) ? 1UL << (log - 1) : 0);
+}
+
+/* report what the allocator holds and what it has done so far */
+struct os_mallinfo os_mallinfo(void)
+{
+	struct os_mallinfo info = {0};
+	uint64_t sum[STAT_COUNT];
+
+	pthread_once(&arenas_once, arenas_init);
+
+	// the heaps are walked one arena at a time, under its lock
+	for (unsigned int i = 0; i < narenas; i++) {
+		struct arena *a = &arenas[i];
+
+		pthread_mutex_lock(&a->lock);
+
+		info.arena += a->region.brk - a->region.base;
+
+		for (struct block_meta *b = a->mem_begin; b; b = block_next(a, b)) {
+			// the blocks of the fast bins are free, but in no bin
+			if (b->status == STATUS_FAST) {
+				info.fordblks += b->size;
+				info.fsmblks += b->size;
+				continue;
+			}
+
+			if (b->status != STATUS_FREE) {
+				info.uordblks += b->size;
+				continue;
+			}
+
+			info.ordblks++;
+			info.fordblks += b->size;
+
+			if (b->size > info.largest)
+				info.largest = b->size;
+		}
+
+		pthread_mutex_unlock(&a->lock);
+	}
+
+	if (info.fordblks)
+		info.fragmentation = (info.fordblks - info.largest) * 100 /
+							 info.fordblks;
+
+	info.slab = slab_bytes();
+	info.cached = mmap_cache_size();
+
+	// freed slab objects may still be in a thread cache, but they are no
+	// longer live
+	stats_sum(sum);
+
+	info.smblks = sum[STAT_SLAB + STAT_ALLOCS] - sum[STAT_SLAB + STAT_FREES];
+	info.smblkhd = sum[STAT_SLAB + STAT_ALLOC_BYTES] -
+				   sum[STAT_SLAB + STAT_FREE_BYTES];
+	info.hblks = sum[STAT_MAPPED + STAT_ALLOCS] -
+				 sum[STAT_MAPPED + STAT_FREES];
+	info.hblkhd = sum[STAT_MAPPED + STAT_ALLOC_BYTES] -
+				  sum[STAT_MAPPED + STAT_FREE_BYTES];
+
+	for (unsigned int kind = STAT_SLAB; kind <= STAT_MAPPED; kind += 4) {
+		info.nmalloc += sum[kind + STAT_ALLOCS];
+		info.nfree += sum[kind + STAT_FREES];
+	}
+
+	info.nrealloc = sum[STAT_REALLOC];
+	info.nsplit = sum[STAT_SPLIT];
+	info.ncoalesce = sum[STAT_COALESCE];
+	info.nmmap = sum[STAT_MMAP];
+	info.nmunmap = sum[STAT_MUNMAP];
+	info.nmremap = sum[STAT_MREMAP];
+	info.ncommit = sum[STAT_COMMIT];
+	info.ndecommit = sum[STAT_DECOMMIT];
+	info.npurge = sum[STAT_PURGE];
+	info.nremote = sum[STAT_REMOTE_FREE];
+	info.nfast = sum[STAT_FAST];
+
+	return info;
+}
+
+/* fill in how many allocations every size class has had, and the smallest
+ * size of each, for up to n classes; returns the number of classes
+ */
+size_t os_malloc_histogram(size_t *sizes, size_t *counts, size_t n)
+{
+	uint64_t sum[STAT_COUNT];
+
+	stats_sum(sum);
+
+	for (size_t i = 0; i < n && i < NSIZE_CLASSES; i++) {
+		if (sizes)
+			sizes[i] = stats_class_size(i);
+		if (counts)
+			counts[i] = sum[STAT_CLASSES + i];
+	}
+
+	return NSIZE_CLASSES;
+}
+
+/* write a line to stderr, without going through stdio, which may allocate */
+void stats_print(const char *fmt, ...)
+{
+	char buf[256];
+	va_list args;
+
+	va_start(args, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, args);
+
+	va_end(args);
+
+	if (len > (int) sizeof(buf) - 1)
+		len = sizeof(buf) - 1;
+
+	// nothing can be done if stderr is gone
+	if (len > 0 && write(STDERR_FILENO, buf, len) < 0)
+		return;
+}
+
+/* print the statistics to stderr, like malloc_stats() */
+void os_malloc_stats(void)
+{
+	struct os_mallinfo info = os_mallinfo();
+	size_t sizes[NSIZE_CLASSES], counts[NSIZE_CLASSES];
+
+	stats_print("heap:   %zu bytes, %zu allocated, %zu free in %zu blocks\n",
+				info.arena, info.uordblks, info.fordblks, info.ordblks);
+	stats_print("        largest free block %zu, fragmentation %zu%%\n",
+				info.largest, info.fragmentation);
+	stats_print("slabs:  %zu bytes, %zu live objects of %zu bytes\n",
+				info.slab, info.smblks, info.smblkhd);
+	stats_print("mapped: %zu live blocks of %zu bytes, %zu cached\n",
+				info.hblks, info.hblkhd, info.cached);
+	stats_print("calls:  %zu malloc, %zu free, %zu realloc\n",
+				info.nmalloc, info.nfree, info.nrealloc);
+	stats_print("blocks: %zu split, %zu coalesced, %zu purged, "
+				"%zu remote frees\n", info.nsplit, info.ncoalesce,
+				info.npurge, info.nremote);
+	stats_print("fast:   %zu bytes waiting, %zu allocations served\n",
+				info.fsmblks, info.nfast);
+	stats_print("system: %zu mmap, %zu munmap, %zu mremap, %zu commit, "
+				"%zu decommit\n", info.nmmap, info.nmunmap, info.nmremap,
+				info.ncommit, info.ndecommit);
+
+	os_malloc_histogram(sizes, counts, NSIZE_CLASSES);
+
+	stats_print("size classes:\n");
+
+	for (unsigned int i = 0; i < NSIZE_CLASSES; i++)
+		if (counts[i])
+			stats_print("  >= %8zu: %zu\n", sizes[i], counts[i]);
+}
@@ -0,0 +1,372 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// for mremap()
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "osmem.h"
+#include "helpers.h"
+#include "trace.h"
+
+// every thread has a ring of this many records
+#define TRACE_RING 4096
+
+// the file is grown, and mapped, this many bytes at a time
+#define TRACE_FILE_CHUNK (64UL * 1024 * 1024)
+
+// how often the flusher empties the rings
+#define TRACE_FLUSH_MS 10
+
+// the ring of a thread has a single writer, the thread, and a single
+// reader, whoever holds trace_lock; head and tail only grow, and are on
+// cache lines of their own
+struct trace_ring {
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	struct trace_ring *next;
+	uint32_t thread;
+	// set once the thread has exited, the ring is then free to be taken
+	// by a new thread once it is empty
+	int dead;
+	struct trace_record records[TRACE_RING];
+};
+
+// the entry points only look at trace_on while tracing is off; calls made
+// from inside another call are not recorded, as trace_depth is not 0
+int trace_on;
+__thread int trace_depth;
+__thread struct trace_ring *trace_ring;
+
+// the rings, the file they are flushed to and the flusher, all under
+// trace_lock; the file is mapped, and grown with ftruncate() and mremap()
+struct trace_ring *trace_rings;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+pthread_key_t trace_key;
+pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+pthread_t trace_flusher;
+int trace_stopping;
+int trace_fd = -1;
+char *trace_map;
+size_t trace_mapped;
+size_t trace_used;
+int trace_error;
+
+
+uint64_t trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* the ring of an exiting thread can be given to a new one; what the later
+ * destructors of the thread do gets a ring again
+ */
+void trace_ring_destroy(void *arg)
+{
+	struct trace_ring *ring = arg;
+
+	trace_ring = NULL;
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+void trace_key_create(void)
+{
+	pthread_key_create(&trace_key, trace_ring_destroy);
+}
+
+/* get a ring for the calling thread: an empty one left by a thread that
+ * has exited, or a fresh one
+ */
+struct trace_ring *trace_ring_get(void)
+{
+	struct trace_ring *ring;
+
+	// pthread_setspecific() may allocate
+	trace_depth++;
+	pthread_once(&trace_once, trace_key_create);
+
+	pthread_mutex_lock(&trace_lock);
+
+	for (ring = trace_rings; ring; ring = ring->next)
+		if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) &&
+			ring->head == ring->tail)
+			break;
+
+	if (ring) {
+		ring->dead = 0;
+	} else {
+		ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (ring != MAP_FAILED) {
+			ring->next = trace_rings;
+			trace_rings = ring;
+		} else {
+			ring = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+
+	if (ring) {
+		ring->thread = syscall(SYS_gettid);
+		trace_ring = ring;
+		pthread_setspecific(trace_key, ring);
+	}
+
+	trace_depth--;
+
+	return ring;
+}
+
+/* copy records to the end of the file, growing it if needed; records are
+ * dropped if there is no file, or it cannot grow;
+ * the trace lock must be held
+ */
+void trace_write(struct trace_record *records, size_t n)
+{
+	size_t len = n * sizeof(*records);
+
+	if (trace_fd == -1 || trace_error)
+		return;
+
+	if (trace_used + len > trace_mapped) {
+		size_t new_len = trace_mapped + (len > TRACE_FILE_CHUNK ? len :
+										 TRACE_FILE_CHUNK);
+		char *map = MAP_FAILED;
+
+		if (ftruncate(trace_fd, new_len) == 0)
+			map = mremap(trace_map, trace_mapped, new_len, MREMAP_MAYMOVE);
+
+		if (map == MAP_FAILED) {
+			trace_error = errno;
+			return;
+		}
+
+		trace_map = map;
+		trace_mapped = new_len;
+	}
+
+	memcpy(trace_map + trace_used, records, len);
+	trace_used += len;
+}
+
+/* move what a ring holds to the file; the trace lock must be held */
+void trace_drain(struct trace_ring *ring)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = ring->tail;
+
+	// at most two copies, for the records before and after the end of
+	// the ring
+	while (tail != head) {
+		size_t start = tail % TRACE_RING;
+		size_t n = head - tail < TRACE_RING - start ? head - tail :
+				   TRACE_RING - start;
+
+		trace_write(&ring->records[start], n);
+		tail += n;
+	}
+
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+/* the trace lock must be held */
+void trace_drain_all(void)
+{
+	for (struct trace_ring *ring = trace_rings; ring; ring = ring->next)
+		trace_drain(ring);
+}
+
+/* record a call of an entry point, see TRACE() */
+void trace_event(unsigned int op, void *ptr, void *old, size_t size)
+{
+	struct trace_ring *ring = trace_ring;
+
+	if (trace_depth)
+		return;
+
+	if (!ring && !(ring = trace_ring_get()))
+		return;
+
+	uint64_t head = ring->head;
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	// the flusher is behind: the thread empties its own ring, so no
+	// record is ever lost
+	if (head - tail == TRACE_RING) {
+		pthread_mutex_lock(&trace_lock);
+		trace_drain(ring);
+		pthread_mutex_unlock(&trace_lock);
+	}
+
+	struct trace_record *r = &ring->records[head % TRACE_RING];
+
+	r->ptr = (uintptr_t) ptr;
+	r->old = (uintptr_t) old;
+	r->size = size;
+	r->time = trace_now();
+	r->op = op;
+	r->thread = ring->thread;
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* empty the rings every TRACE_FLUSH_MS, until tracing stops */
+void *trace_flusher_main(void *arg)
+{
+	(void) arg;
+
+	pthread_mutex_lock(&trace_lock);
+
+	while (!trace_stopping) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += TRACE_FLUSH_MS * 1000000L;
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+
+		pthread_cond_timedwait(&trace_cond, &trace_lock, &ts);
+		trace_drain_all();
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+
+	return NULL;
+}
+
+/* start recording every call to the allocator in the file at "path", in
+ * the format of trace.h; returns 0, or -1 with errno set
+ */
+int os_malloc_trace_start(const char *path)
+{
+	struct trace_header header = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.record_size = sizeof(struct trace_record),
+	};
+
+	pthread_mutex_lock(&trace_lock);
+
+	if (trace_fd != -1) {
+		pthread_mutex_unlock(&trace_lock);
+		errno = EBUSY;
+		return -1;
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	char *map = MAP_FAILED;
+
+	if (fd != -1 && ftruncate(fd, TRACE_FILE_CHUNK) == 0)
+		map = mmap(NULL, TRACE_FILE_CHUNK, PROT_READ | PROT_WRITE,
+				   MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED) {
+		int error = errno;
+
+		if (fd != -1)
+			close(fd);
+
+		pthread_mutex_unlock(&trace_lock);
+		errno = error;
+		return -1;
+	}
+
+	memcpy(map, &header, sizeof(header));
+
+	trace_fd = fd;
+	trace_map = map;
+	trace_mapped = TRACE_FILE_CHUNK;
+	trace_used = sizeof(header);
+	trace_error = 0;
+	trace_stopping = 0;
+
+	// what the rings still hold is from an earlier trace
+	for (struct trace_ring *ring = trace_rings; ring; ring = ring->next)
+		ring->tail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	pthread_mutex_unlock(&trace_lock);
+
+	// pthread_create() may allocate, which takes the locks of the
+	// allocator, so it is called without the trace lock
+	int ret = pthread_create(&trace_flusher, NULL, trace_flusher_main, NULL);
+
+	if (ret) {
+		pthread_mutex_lock(&trace_lock);
+		munmap(trace_map, trace_mapped);
+		close(trace_fd);
+		trace_fd = -1;
+		pthread_mutex_unlock(&trace_lock);
+		errno = ret;
+		return -1;
+	}
+
+	__atomic_store_n(&trace_on, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/* stop tracing and write out the rest of the trace; calls made while it
+ * stops may be left out; returns 0, or -1 with errno set if some records
+ * could not be written
+ */
+int os_malloc_trace_stop(void)
+{
+	if (!__atomic_exchange_n(&trace_on, 0, __ATOMIC_RELAXED)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	trace_stopping = 1;
+	pthread_cond_signal(&trace_cond);
+	pthread_mutex_unlock(&trace_lock);
+
+	pthread_join(trace_flusher, NULL);
+
+	pthread_mutex_lock(&trace_lock);
+
+	trace_drain_all();
+
+	int error = trace_error;
+
+	munmap(trace_map, trace_mapped);
+
+	// the file ends right after the last record
+	if (ftruncate(trace_fd, trace_used) == -1 && !error)
+		error = errno;
+
+	if (close(trace_fd) == -1 && !error)
+		error = errno;
+
+	trace_fd = -1;
+
+	pthread_mutex_unlock(&trace_lock);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* the child of a fork() has no flusher, and the file is the parent's */
+void trace_fork_child(void)
+{
+	if (trace_fd == -1)
+		return;
+
+	__atomic_store_n(&trace_on, 0, __ATOMIC_RELAXED);
+	munmap(trace_map, trace_mapped);
+	close(trace_fd);
+	trace_fd = -1;
+}
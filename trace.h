@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+#include <stdint.h>
+
+/* A trace is a log of the allocation calls of a program, written by
+ * os_malloc_trace_start() and replayed by "bench -t file": a struct
+ * trace_header, followed by struct trace_record entries. The records of
+ * one thread are in the order of its calls, the ones of different threads
+ * may not be, and are put in order by their time. Pointers are only used
+ * to tell blocks apart, so any unique id will do; a log in another format
+ * only needs converting to these records.
+ */
+
+#define TRACE_MAGIC		"OSMTRACE"
+#define TRACE_VERSION	1
+
+/* trace_record ops; 0 is left for the unused end of a trace */
+#define TRACE_MALLOC	1	/* ptr = malloc(size) */
+#define TRACE_FREE		2	/* free(ptr) */
+#define TRACE_REALLOC	3	/* ptr = realloc(old, size) */
+#define TRACE_CALLOC	4	/* ptr = calloc(1, size) */
+#define TRACE_MEMALIGN	5	/* ptr = memalign(old, size), old = alignment */
+
+struct trace_header {
+	char magic[8];			/* TRACE_MAGIC, without the final 0 */
+	uint32_t version;		/* TRACE_VERSION */
+	uint32_t record_size;	/* sizeof(struct trace_record) */
+};
+
+struct trace_record {
+	uint64_t ptr;			/* the block returned, or the one freed */
+	uint64_t old;			/* the block given to realloc() */
+	uint64_t size;			/* the size asked for */
+	uint64_t time;			/* CLOCK_MONOTONIC ns, see trace.c */
+	uint32_t op;			/* TRACE_* */
+	uint32_t thread;		/* the thread that made the call */
+};